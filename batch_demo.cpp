@@ -0,0 +1,91 @@
+#include "demo_util.hpp"
+#include "pir.hpp"
+#include "pir_batch.hpp"
+#include <seal/seal.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace seal;
+
+// Retrieves a batch of elements chosen so that cuckoo placement has to evict
+// one, and checks every element against the database.
+int main(int argc, char *argv[]) {
+
+    uint64_t number_of_items = 1 << 12;
+    uint64_t size_per_item = 288; // in bytes
+    uint32_t max_batch = 4;
+    uint32_t N = 4096;
+    uint32_t logt = 20;
+    uint32_t d = 2;
+
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    BatchParams batch_params;
+    gen_batch_params(number_of_items, size_per_item, max_batch, N, logt, d, params, pir_params,
+                     batch_params);
+    cout << "Batch: " << batch_params.num_buckets << " buckets of " << batch_params.bucket_size
+         << " elements" << endl;
+
+    random_device rd;
+    auto db = make_unique<uint8_t[]>(number_of_items * size_per_item);
+    seeded_database(random_seed())(db.get(), number_of_items * size_per_item);
+
+    // An element whose buckets are all taken by elements placed before it:
+    // each of those has one of its buckets first, where placement puts it, and
+    // a second bucket outside them, so the batch still fits
+    BatchLayout layout(batch_params);
+    uint32_t num_hashes = batch_params.num_hashes;
+    vector<uint32_t> target(num_hashes);
+    vector<uint32_t> buckets(num_hashes);
+    vector<uint64_t> elements;
+    uint64_t x = rd() % number_of_items;
+    layout.buckets(x, target.data());
+    vector<uint32_t> spare;
+    for (uint32_t j = 0; j < num_hashes; j++) {
+        for (uint64_t e = 0; e < number_of_items; e++) {
+            layout.buckets(e, buckets.data());
+            bool outside = find(target.begin(), target.end(), buckets[1]) == target.end() &&
+                           find(spare.begin(), spare.end(), buckets[1]) == spare.end();
+            if (e != x && buckets[0] == target[j] && outside &&
+                find(elements.begin(), elements.end(), e) == elements.end()) {
+                elements.push_back(e);
+                spare.push_back(buckets[1]);
+                break;
+            }
+        }
+    }
+    if (elements.size() != num_hashes) {
+        cout << "Batch: no batch that forces an eviction" << endl;
+        return -1;
+    }
+    elements.push_back(x);
+
+    PIRBatchServer server(params, pir_params, batch_params);
+    server.set_num_threads(thread::hardware_concurrency());
+    unique_ptr<const uint8_t[]> bytes(move(db));
+    server.set_database(bytes);
+
+    PIRBatchClient client(params, pir_params, batch_params);
+    server.set_galois_key(0, client.generate_galois_keys());
+
+    vector<PirQuery> queries = client.generate_query(elements);
+    vector<PirReply> replies = server.generate_reply(queries, 0);
+    vector<vector<uint8_t>> result = client.decode_reply(replies);
+
+    for (size_t i = 0; i < elements.size(); i++) {
+        const uint8_t *expected = bytes.get() + elements[i] * size_per_item;
+        if (result[i].size() != size_per_item ||
+            !equal(result[i].begin(), result[i].end(), expected)) {
+            cout << "Batch: element " << elements[i] << " wrong!" << endl;
+            return -1;
+        }
+    }
+    cout << "Batch: " << elements.size() << " elements correct, including one placed by "
+         << "eviction" << endl;
+    return 0;
+}
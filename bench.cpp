@@ -0,0 +1,289 @@
+#include "demo_util.hpp"
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_server.hpp"
+#include <seal/seal.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+using namespace std;
+using namespace seal;
+
+// Benchmarks for tracking performance across changes and machines.
+//
+//   bench [--ele-num 1024,16384] [--ele-size 288] [--N 4096] [--logt 16]
+//         [--d 1,2] [--mod-switch 0,1] [--reps 3] [--threads T]
+//         [--sweep-only | --micro-only]
+//
+// Every combination of the listed values is run end to end, followed by
+// microbenchmarks of the individual kernels. Results are printed as one JSON
+// document on stdout; times are medians over the repetitions, in microseconds.
+
+struct BenchConfig {
+    uint64_t ele_num;
+    uint64_t ele_size;
+    uint32_t N;
+    uint32_t logt;
+    uint32_t d;
+    bool mod_switch;
+};
+
+// Median wall time of fn over reps runs
+double median_us(uint32_t reps, const function<void()> &fn) {
+    vector<double> times;
+    for (uint32_t r = 0; r < reps; r++) {
+        auto start = steady_clock::now();
+        fn();
+        times.push_back(duration<double, micro>(steady_clock::now() - start).count());
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+double to_us(nanoseconds t) {
+    return duration<double, micro>(t).count();
+}
+
+string config_json(const BenchConfig &config) {
+    ostringstream out;
+    out << "\"ele_num\": " << config.ele_num << ", \"ele_size\": " << config.ele_size
+        << ", \"N\": " << config.N << ", \"logt\": " << config.logt << ", \"d\": " << config.d
+        << ", \"mod_switch\": " << (config.mod_switch ? "true" : "false");
+    return out.str();
+}
+
+class PIRBenchmark {
+  public:
+    PIRBenchmark(uint32_t reps, uint32_t threads) : reps_(reps), threads_(threads) {}
+
+    // End-to-end run of one configuration, as a JSON object
+    string run_config(const BenchConfig &config) {
+        ostringstream out;
+        out << "{" << config_json(config);
+
+        EncryptionParameters params(scheme_type::BFV);
+        PirParams pir_params;
+        gen_params(config.ele_num, config.ele_size, config.N, config.logt, config.d, params,
+                   pir_params, config.mod_switch);
+        auto context = SEALContext::Create(params, false);
+        if (!context->parameters_set()) {
+            out << ", \"error\": \"" << context->parameter_error_message() << "\"}";
+            return out.str();
+        }
+
+        PIRServer server(params, pir_params);
+        server.set_num_threads(threads_);
+        PIRClient client(params, pir_params);
+        server.set_galois_key(0, client.generate_galois_keys());
+
+        uint64_t seed = 42;
+        double setup_us = median_us(reps_, [&] {
+            server.set_database(seeded_database(seed), config.ele_num, config.ele_size);
+        });
+
+        uint64_t ele_index = config.ele_num / 2;
+        uint64_t index = client.get_fv_index(ele_index, config.ele_size);
+        uint64_t offset = client.get_fv_offset(ele_index, config.ele_size);
+
+        PirQuery query;
+        double query_us = median_us(reps_, [&] { query = client.generate_query(index); });
+        client.set_symmetric_queries(true);
+        double symmetric_query_us = median_us(reps_, [&] { client.generate_query(index); });
+        client.set_symmetric_queries(false);
+
+        ReplyStats stats;
+        server.set_reply_observer([&stats](const ReplyStats &s) { stats = s; });
+        PirReply reply;
+        double reply_us = median_us(reps_, [&] { server.generate_reply(query, 0, reply); });
+
+        Plaintext result;
+        double decode_us = median_us(reps_, [&] { result = client.decode_reply(reply); });
+
+        // Check the element against the regenerated database
+        bool correct =
+            check_seeded_element(params, result, seed, ele_index, offset, config.ele_size);
+
+        out << ", \"nvec\": [";
+        for (size_t i = 0; i < pir_params.nvec.size(); i++) {
+            out << (i ? ", " : "") << pir_params.nvec[i];
+        }
+        out << "], \"correct\": " << (correct ? "true" : "false")
+            << ", \"setup_us\": " << setup_us
+            << ", \"query_us\": " << query_us
+            << ", \"symmetric_query_us\": " << symmetric_query_us
+            << ", \"reply_us\": " << reply_us
+            << ", \"decode_us\": " << decode_us
+            << ", \"query_bytes\": " << serialize_query(query).size()
+            << ", \"seeded_query_bytes\": " << client.generate_serialized_query(index).size()
+            << ", \"reply_bytes\": " << serialize_ciphertexts(reply).size()
+            << ", \"galois_applications\": " << stats.galois_applications
+            << ", \"plain_multiplications\": " << stats.plain_multiplications
+            << ", \"levels\": [";
+        for (size_t i = 0; i < stats.levels.size(); i++) {
+            const ReplyLevelStats &level = stats.levels[i];
+            out << (i ? ", " : "") << "{\"decomposition_us\": " << to_us(level.decomposition)
+                << ", \"expansion_us\": " << to_us(level.expansion)
+                << ", \"inner_product_us\": " << to_us(level.inner_product)
+                << ", \"inverse_ntt_us\": " << to_us(level.inverse_ntt) << "}";
+        }
+        out << "]}";
+        return out.str();
+    }
+
+    // Kernels of the server and client on one configuration, as a JSON object
+    string run_kernels(const BenchConfig &config) {
+        EncryptionParameters params(scheme_type::BFV);
+        PirParams pir_params;
+        gen_params(config.ele_num, config.ele_size, config.N, config.logt, config.d, params,
+                   pir_params);
+
+        PIRServer server(params, pir_params);
+        server.set_num_threads(1);
+        PIRClient client(params, pir_params);
+        server.set_galois_key(0, client.generate_galois_keys());
+
+        PirQuery query = client.generate_query(0);
+        const Ciphertext &encrypted = query[0][0];
+        uint32_t N = config.N;
+        // The width the server packs and decomposes with, one bit below t's
+        uint32_t logtp = floor(log2(params.plain_modulus().value()));
+
+        ostringstream out;
+        out << "{" << config_json(config);
+
+        out << ", \"expand_query_us\": " << median_us(reps_, [&] {
+            server.expand_query(encrypted, N, 0);
+        });
+
+        Ciphertext shifted;
+        out << ", \"multiply_power_of_X_us\": " << median_us(reps_, [&] {
+            server.multiply_power_of_X(encrypted, shifted, N - 1);
+        });
+
+        vector<Plaintext> plains(pir_params.expansion_ratio, Plaintext(N));
+        out << ", \"decompose_to_plaintexts_us\": " << median_us(reps_, [&] {
+            server.decompose_to_plaintexts_ptr(encrypted, plains.data(), logtp);
+        });
+
+        Ciphertext composed;
+        out << ", \"compose_to_ciphertext_us\": " << median_us(reps_, [&] {
+            client.compose_to_ciphertext(plains.data(), composed);
+        });
+
+        // One plaintext's worth of bytes
+        uint64_t bytes_per_ptxt = elements_per_ptxt(logtp, N, config.ele_size) * config.ele_size;
+        vector<uint8_t> bytes(bytes_per_ptxt);
+        mt19937_64 gen(7);
+        for (auto &b : bytes) {
+            b = gen() % 256;
+        }
+        vector<uint64_t> coeffs;
+        out << ", \"bytes_to_coeffs_us\": " << median_us(reps_, [&] {
+            coeffs = bytes_to_coeffs(logtp, bytes.data(), bytes.size());
+        });
+
+        Plaintext plain;
+        coeffs.resize(N, 1);
+        vector_to_plaintext(coeffs, plain);
+        out << ", \"coeffs_to_bytes_us\": " << median_us(reps_, [&] {
+            coeffs_to_bytes(logtp, plain, bytes.data(), bytes.size());
+        });
+
+        out << "}";
+        return out.str();
+    }
+
+  private:
+    uint32_t reps_;
+    uint32_t threads_;
+};
+
+template <typename T>
+vector<T> parse_list(const string &arg) {
+    vector<T> values;
+    stringstream in(arg);
+    string item;
+    while (getline(in, item, ',')) {
+        values.push_back(static_cast<T>(stoull(item)));
+    }
+    return values;
+}
+
+int main(int argc, char *argv[]) {
+    vector<uint64_t> ele_nums = {1 << 10, 1 << 14};
+    vector<uint64_t> ele_sizes = {288};
+    vector<uint32_t> Ns = {4096};
+    vector<uint32_t> logts = {16};
+    vector<uint32_t> ds = {1, 2};
+    vector<uint32_t> mod_switches = {0};
+    uint32_t reps = 3;
+    uint32_t threads = max(1u, thread::hardware_concurrency());
+    bool sweep = true;
+    bool micro = true;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--ele-num" && has_value) {
+            ele_nums = parse_list<uint64_t>(argv[++i]);
+        } else if (arg == "--ele-size" && has_value) {
+            ele_sizes = parse_list<uint64_t>(argv[++i]);
+        } else if (arg == "--N" && has_value) {
+            Ns = parse_list<uint32_t>(argv[++i]);
+        } else if (arg == "--logt" && has_value) {
+            logts = parse_list<uint32_t>(argv[++i]);
+        } else if (arg == "--d" && has_value) {
+            ds = parse_list<uint32_t>(argv[++i]);
+        } else if (arg == "--mod-switch" && has_value) {
+            mod_switches = parse_list<uint32_t>(argv[++i]);
+        } else if (arg == "--reps" && has_value) {
+            reps = max(1u, static_cast<uint32_t>(stoul(argv[++i])));
+        } else if (arg == "--threads" && has_value) {
+            threads = max(1u, static_cast<uint32_t>(stoul(argv[++i])));
+        } else if (arg == "--sweep-only") {
+            micro = false;
+        } else if (arg == "--micro-only") {
+            sweep = false;
+        } else {
+            cerr << "unknown argument " << arg << endl;
+            return 1;
+        }
+    }
+
+    // stdout only carries the JSON document
+    set_log_level(LogLevel::none);
+    PIRBenchmark bench(reps, threads);
+
+    cout << "{\"reps\": " << reps << ", \"threads\": " << threads << ",\n \"configs\": [";
+    bool first = true;
+    if (sweep) {
+        for (auto N : Ns) for (auto logt : logts) for (auto d : ds) for (auto ms : mod_switches)
+        for (auto ele_size : ele_sizes) for (auto ele_num : ele_nums) {
+            cout << (first ? "\n  " : ",\n  ")
+                 << bench.run_config({ele_num, ele_size, N, logt, d, ms != 0}) << flush;
+            first = false;
+        }
+    }
+    cout << "],\n \"kernels\": [";
+    first = true;
+    if (micro) {
+        for (auto N : Ns) for (auto logt : logts) {
+            cout << (first ? "\n  " : ",\n  ")
+                 << bench.run_kernels({ele_nums[0], ele_sizes[0], N, logt, 2, false}) << flush;
+            first = false;
+        }
+    }
+    cout << "]}" << endl;
+    return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pir.hpp"
+#include <seal/seal.h>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+// Random test databases for main, bench, the demos and PIRTuner::verify. The
+// bytes are generated from a seed while the server reads them, so neither side
+// keeps a full copy, and any element is regenerated from the same seed to
+// check a result.
+
+// A seed from the system's random device
+inline std::uint64_t random_seed() {
+    std::random_device rd;
+    return (static_cast<std::uint64_t>(rd()) << 32) | rd();
+}
+
+// A reader for set_database producing the database of seed, starting skip
+// bytes in. Each reader starts over, so one is needed per pass.
+inline std::function<void(std::uint8_t *, std::uint64_t)> seeded_database(std::uint64_t seed,
+                                                                         std::uint64_t skip = 0) {
+    std::mt19937_64 gen(seed);
+    gen.discard(skip);
+    return [gen](std::uint8_t *buffer, std::uint64_t size) mutable {
+        for (std::uint64_t i = 0; i < size; i++) {
+            buffer[i] = gen() % 256;
+        }
+    };
+}
+
+// Whether result, the decoded plaintext that holds element ele_index at
+// offset, holds that element of the database of seed
+inline bool check_seeded_element(const seal::EncryptionParameters &params,
+                                 const seal::Plaintext &result, std::uint64_t seed,
+                                 std::uint64_t ele_index, std::uint64_t offset,
+                                 std::uint64_t ele_size) {
+    std::uint32_t logtp = std::floor(std::log2(params.plain_modulus().value()));
+    std::vector<std::uint8_t> elems(params.poly_modulus_degree() * logtp / 8);
+    coeffs_to_bytes(logtp, result, elems.data(), elems.size());
+    if ((offset + 1) * ele_size > elems.size()) {
+        return false;
+    }
+
+    std::vector<std::uint8_t> expected(ele_size);
+    seeded_database(seed, ele_index * ele_size)(expected.data(), ele_size);
+    for (std::uint64_t i = 0; i < ele_size; i++) {
+        if (elems[offset * ele_size + i] != expected[i]) {
+            return false;
+        }
+    }
+    return true;
+}
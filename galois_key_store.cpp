@@ -0,0 +1,181 @@
+#include "galois_key_store.hpp"
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+using namespace seal;
+
+GaloisKeyStore::GaloisKeyStore(shared_ptr<SEALContext> context, size_t memory_budget,
+                               string spill_dir) :
+    context_(move(context)),
+    memory_budget_(memory_budget),
+    spill_dir_(move(spill_dir)),
+    resident_bytes_(0),
+    inserts_(0),
+    stats_()
+{}
+
+string GaloisKeyStore::spill_path(uint32_t client_id) const {
+    return spill_dir_ + "/galois_" + to_string(client_id) + ".bin";
+}
+
+void GaloisKeyStore::insert(uint32_t client_id, GaloisKeys keys) {
+    size_t bytes = keys.save_size(compr_mode_type::none);
+
+    // Keys are written when inserted, so evicting them never does any I/O.
+    // The file is written to a temporary name without the lock, and renamed
+    // under it together with the update of the entry, so that the file and
+    // the keys in memory come from the same insert. The rename also makes a
+    // concurrent reload see either the old or the new file.
+    string path;
+    string temp_path;
+    if (!spill_dir_.empty()) {
+        path = spill_path(client_id);
+        temp_path = path + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+        ofstream out(temp_path, ios::binary | ios::trunc);
+        if (!out) {
+            throw runtime_error("cannot open " + temp_path + " for writing");
+        }
+        keys.save(out, compr_mode_type::none);
+        out.close();
+        if (!out) {
+            remove(temp_path.c_str());
+            throw runtime_error("failed to write " + temp_path);
+        }
+    }
+    auto shared = make_shared<const GaloisKeys>(move(keys));
+
+    lock_guard<mutex> lock(mutex_);
+    if (!temp_path.empty() && rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        throw runtime_error("failed to write " + path);
+    }
+    auto it = entries_.find(client_id);
+    if (it == entries_.end()) {
+        it = entries_.emplace(client_id, Entry{nullptr, 0, lru_.end(), 0}).first;
+    } else if (it->second.keys) {
+        resident_bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru);
+    }
+    it->second.bytes = bytes;
+    it->second.version = ++inserts_;
+    make_resident(client_id, it->second, move(shared));
+}
+
+shared_ptr<const GaloisKeys> GaloisKeyStore::find(uint32_t client_id) {
+    uint64_t version;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = entries_.find(client_id);
+        if (it == entries_.end()) {
+            stats_.misses++;
+            return nullptr;
+        }
+        if (it->second.keys) {
+            stats_.hits++;
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return it->second.keys;
+        }
+        stats_.misses++;
+        version = it->second.version;
+    }
+
+    while (true) {
+        // Read the keys back without holding the lock, so lookups of other
+        // clients are not held up by the disk. The file was written by
+        // insert, so the validity checks of load are skipped. A file that
+        // cannot be opened may have been removed by a concurrent erase, which
+        // is only known once the entry is looked up again.
+        auto keys = make_shared<GaloisKeys>();
+        ifstream in(spill_path(client_id), ios::binary);
+        bool opened = static_cast<bool>(in);
+        if (opened) {
+            keys->unsafe_load(context_, in);
+        }
+
+        lock_guard<mutex> lock(mutex_);
+        auto it = entries_.find(client_id);
+        if (it == entries_.end()) {
+            return nullptr; // erased meanwhile, with its file
+        }
+        if (it->second.keys) {
+            // another lookup reloaded them first, or they were replaced
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return it->second.keys;
+        }
+        if (it->second.version != version) {
+            // replaced and evicted again while reading; the file may be older
+            version = it->second.version;
+            continue;
+        }
+        if (!opened) {
+            throw runtime_error("cannot read spilled Galois keys of client " +
+                                to_string(client_id));
+        }
+        stats_.reloads++;
+        make_resident(client_id, it->second, keys);
+        return keys;
+    }
+}
+
+void GaloisKeyStore::erase(uint32_t client_id) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = entries_.find(client_id);
+    if (it == entries_.end()) {
+        return;
+    }
+    if (it->second.keys) {
+        resident_bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru);
+    }
+    entries_.erase(it);
+    if (!spill_dir_.empty()) {
+        remove(spill_path(client_id).c_str());
+    }
+}
+
+void GaloisKeyStore::set_memory_budget(size_t memory_budget) {
+    lock_guard<mutex> lock(mutex_);
+    memory_budget_ = memory_budget;
+    evict();
+}
+
+GaloisKeyStoreStats GaloisKeyStore::stats() const {
+    lock_guard<mutex> lock(mutex_);
+    GaloisKeyStoreStats result = stats_;
+    result.resident_keys = lru_.size();
+    result.resident_bytes = resident_bytes_;
+    result.spilled_keys = entries_.size() - lru_.size();
+    return result;
+}
+
+// Must hold mutex_
+void GaloisKeyStore::make_resident(uint32_t client_id, Entry &entry,
+                                   shared_ptr<const GaloisKeys> keys) {
+    entry.keys = move(keys);
+    lru_.push_front(client_id);
+    entry.lru = lru_.begin();
+    resident_bytes_ += entry.bytes;
+    evict();
+}
+
+// Drops least recently used keys until the budget is met, always keeping the
+// most recent ones. Without a spill directory the keys are forgotten. Must
+// hold mutex_.
+void GaloisKeyStore::evict() {
+    while (memory_budget_ != 0 && resident_bytes_ > memory_budget_ && lru_.size() > 1) {
+        uint32_t victim = lru_.back();
+        lru_.pop_back();
+        auto it = entries_.find(victim);
+        resident_bytes_ -= it->second.bytes;
+        stats_.evictions++;
+        if (spill_dir_.empty()) {
+            entries_.erase(it);
+        } else {
+            it->second.keys.reset();
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "seal/seal.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct GaloisKeyStoreStats {
+    std::uint64_t hits;       // lookups served from memory
+    std::uint64_t misses;     // lookups of keys not in memory (reloaded or unknown)
+    std::uint64_t reloads;    // misses served from the spill directory
+    std::uint64_t evictions;  // key sets dropped from memory to stay within the budget
+    std::size_t resident_keys;
+    std::size_t resident_bytes;
+    std::size_t spilled_keys; // key sets only available on disk
+};
+
+// Galois keys of the clients of one or more servers, kept within a memory
+// budget. When the budget is exceeded the least recently used key sets are
+// dropped from memory; with a spill directory they are written there when
+// inserted and read back on the next lookup, otherwise the client has to send
+// them again. All methods can be called concurrently.
+class GaloisKeyStore {
+  public:
+    // memory_budget is in bytes, 0 means unlimited
+    GaloisKeyStore(std::shared_ptr<seal::SEALContext> context, std::size_t memory_budget = 0,
+                   std::string spill_dir = "");
+
+    // Adds or replaces the keys of client_id
+    void insert(std::uint32_t client_id, seal::GaloisKeys keys);
+
+    // Keys of client_id, reloaded from disk if needed, or null if they are
+    // unknown. Never adds an entry. The keys stay valid for as long as the
+    // returned pointer is held, even if they are evicted meanwhile.
+    std::shared_ptr<const seal::GaloisKeys> find(std::uint32_t client_id);
+
+    void erase(std::uint32_t client_id);
+
+    void set_memory_budget(std::size_t memory_budget);
+
+    GaloisKeyStoreStats stats() const;
+
+  private:
+    struct Entry {
+        std::shared_ptr<const seal::GaloisKeys> keys; // null when not in memory
+        std::size_t bytes;
+        std::list<std::uint32_t>::iterator lru;
+        std::uint64_t version; // the insert that wrote keys and spill file
+    };
+
+    std::shared_ptr<seal::SEALContext> context_;
+    std::size_t memory_budget_;
+    std::string spill_dir_;
+    std::unordered_map<std::uint32_t, Entry> entries_;
+    std::list<std::uint32_t> lru_; // clients with keys in memory, most recent first
+    std::size_t resident_bytes_;
+    std::uint64_t inserts_; // numbers the inserts, so versions are never reused
+    GaloisKeyStoreStats stats_;
+    mutable std::mutex mutex_;
+
+    std::string spill_path(std::uint32_t client_id) const;
+    void make_resident(std::uint32_t client_id, Entry &entry,
+                       std::shared_ptr<const seal::GaloisKeys> keys);
+    void evict();
+};
@@ -0,0 +1,94 @@
+#include "demo_util.hpp"
+#include "galois_key_store.hpp"
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_server.hpp"
+#include <seal/seal.h>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+using namespace seal;
+
+// Answers two clients from a key store that only has room for one key set in
+// memory, so the first client's keys are spilled to disk and reloaded for its
+// query.
+int main(int argc, char *argv[]) {
+
+    uint64_t number_of_items = 1 << 10;
+    uint64_t size_per_item = 288; // in bytes
+    uint32_t N = 4096;
+    uint32_t logt = 20;
+    uint32_t d = 2;
+
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    gen_params(number_of_items, size_per_item, N, logt, d, params, pir_params);
+
+    random_device rd;
+    uint64_t db_seed = random_seed();
+    PIRServer server(params, pir_params);
+    server.set_num_threads(thread::hardware_concurrency());
+    server.set_database(seeded_database(db_seed), number_of_items, size_per_item);
+
+    char spill_dir[] = "/tmp/sealpir-keys-XXXXXX";
+    if (!mkdtemp(spill_dir)) {
+        cout << "KeyStore: cannot create a spill directory" << endl;
+        return -1;
+    }
+
+    vector<unique_ptr<PIRClient>> clients;
+    vector<GaloisKeys> keys;
+    for (uint32_t c = 0; c < 2; c++) {
+        clients.push_back(make_unique<PIRClient>(params, pir_params));
+        keys.push_back(clients[c]->generate_galois_keys());
+    }
+    size_t key_bytes = keys[0].save_size(compr_mode_type::none);
+    auto store = make_shared<GaloisKeyStore>(SEALContext::Create(params, true), key_bytes,
+                                             spill_dir);
+    for (uint32_t c = 0; c < 2; c++) {
+        store->insert(c, move(keys[c]));
+    }
+    server.set_galois_key_store(store);
+
+    int status = 0;
+    GaloisKeyStoreStats stats = store->stats();
+    if (stats.evictions != 1 || stats.spilled_keys != 1) {
+        cout << "KeyStore: expected client 0's keys to be spilled" << endl;
+        status = -1;
+    }
+
+    // Client 0's keys come back from disk, then client 1's
+    for (uint32_t c = 0; c < 2 && status == 0; c++) {
+        uint64_t ele_index = rd() % number_of_items;
+        uint64_t index = clients[c]->get_fv_index(ele_index, size_per_item);
+        uint64_t offset = clients[c]->get_fv_offset(ele_index, size_per_item);
+        PirReply reply = server.generate_reply(clients[c]->generate_query(index), c);
+        Plaintext result = clients[c]->decode_reply(reply, index);
+        if (!check_seeded_element(params, result, db_seed, ele_index, offset, size_per_item)) {
+            cout << "KeyStore: PIR result of client " << c << " wrong!" << endl;
+            status = -1;
+        }
+    }
+
+    stats = store->stats();
+    if (status == 0 && stats.reloads != 2) {
+        cout << "KeyStore: expected both key sets to be reloaded, got " << stats.reloads
+             << endl;
+        status = -1;
+    }
+    if (status == 0) {
+        cout << "KeyStore: both clients answered correctly with reloaded keys" << endl;
+    }
+
+    for (uint32_t c = 0; c < 2; c++) {
+        store->erase(c);
+    }
+    rmdir(spill_dir);
+    return status;
+}
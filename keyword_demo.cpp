@@ -0,0 +1,75 @@
+#include "demo_util.hpp"
+#include "pir.hpp"
+#include "pir_keyword.hpp"
+#include <seal/seal.h>
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace seal;
+
+// Looks up a key that is in the database and one that is not, and checks the
+// value of the first and the absence of the second.
+int main(int argc, char *argv[]) {
+
+    uint64_t number_of_entries = 1 << 12;
+    uint64_t key_size = 32;   // in bytes
+    uint64_t value_size = 32; // in bytes
+    uint32_t N = 4096;
+    uint32_t logt = 20;
+    uint32_t d = 2;
+
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    KeywordParams keyword_params;
+    gen_keyword_params(number_of_entries, key_size, value_size, N, logt, d, params, pir_params,
+                       keyword_params);
+    cout << "Keyword: " << keyword_params.num_buckets << " buckets of "
+         << keyword_params.bucket_capacity << " entries" << endl;
+
+    // Random keys are distinct with overwhelming probability
+    random_device rd;
+    auto read_random = seeded_database(random_seed());
+    vector<uint8_t> keys(number_of_entries * key_size);
+    vector<uint8_t> values(number_of_entries * value_size);
+    read_random(keys.data(), keys.size());
+    read_random(values.data(), values.size());
+
+    PIRKeywordServer server(params, pir_params, keyword_params);
+    server.set_num_threads(thread::hardware_concurrency());
+    server.set_database(keys.data(), values.data());
+
+    PIRKeywordClient client(params, pir_params, keyword_params);
+    server.set_galois_key(0, client.generate_serialized_galois_keys());
+
+    // A key in the database
+    uint64_t entry = rd() % number_of_entries;
+    const uint8_t *key = keys.data() + entry * key_size;
+    vector<uint8_t> value;
+    PirReply reply = server.generate_reply(client.generate_query(key), 0);
+    if (!client.decode_reply(reply, key, value)) {
+        cout << "Keyword: key of entry " << entry << " not found!" << endl;
+        return -1;
+    }
+    if (value.size() != value_size ||
+        !equal(value.begin(), value.end(), values.begin() + entry * value_size)) {
+        cout << "Keyword: value of entry " << entry << " wrong!" << endl;
+        return -1;
+    }
+    cout << "Keyword: stored key found with the correct value" << endl;
+
+    // A key that is not, sent in the wire format
+    vector<uint8_t> missing(key_size);
+    read_random(missing.data(), missing.size());
+    PirQuery query = server.deserialize_query(client.generate_serialized_query(missing.data()));
+    reply = server.generate_reply(query, 0);
+    if (client.decode_reply(reply, missing.data(), value)) {
+        cout << "Keyword: a key that was never stored was found!" << endl;
+        return -1;
+    }
+    cout << "Keyword: missing key reported as absent" << endl;
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include "demo_util.hpp"
 #include "pir.hpp"
 #include "pir_client.hpp"
 #include "pir_server.hpp"
@@ -5,6 +6,7 @@
 #include <chrono>
 #include <memory>
 #include <random>
+#include <thread>
 #include <cstdint>
 #include <cstddef>
 
@@ -27,7 +29,8 @@ int main(int argc, char *argv[]) {
 
     // Generates all parameters
     cout << "Main: Generating all parameters" << endl;
-    gen_params(number_of_items, size_per_item, N, logt, d, params, pir_params);
+    // Replies are switched to the smallest modulus, which shrinks them
+    gen_params(number_of_items, size_per_item, N, logt, d, params, pir_params, true);
 
     auto context = SEALContext::Create(params, false);
     if (!context->parameters_set()) {
@@ -37,31 +40,23 @@ int main(int argc, char *argv[]) {
 
     cout << "Main: Initializing the database (this may take some time) ..." << endl;
 
-    // Create test database
-    auto db(make_unique<uint8_t[]>(number_of_items * size_per_item));
-
-    // Copy of the database. We use this at the end to make sure we retrieved
-    // the correct element.
-    auto db_copy(make_unique<uint8_t[]>(number_of_items * size_per_item));
-
+    // The test database is generated from a seed while the server reads it, so
+    // neither side keeps a full copy. The expected element is regenerated from
+    // the same seed at the end to check the result.
     random_device rd;
-    for (uint64_t i = 0; i < number_of_items; i++) {
-        for (uint64_t j = 0; j < size_per_item; j++) {
-            auto val = rd() % 256;
-            db.get()[(i * size_per_item) + j] = val;
-            db_copy.get()[(i * size_per_item) + j] = val;
-        }
-    }
+    uint64_t db_seed = random_seed();
 
     // Initialize PIR Server
     cout << "Main: Initializing server" << endl;
     PIRServer server(params, pir_params);
+    server.set_num_threads(thread::hardware_concurrency());
 
     // Initialize PIR client....
     cout << "Main: Initializing client" << endl;
     PIRClient client(params, pir_params);
     cout << "Main: Generating Galois Keys" << endl;
-    GaloisKeys galois_keys = client.generate_galois_keys();
+    string galois_keys = client.generate_serialized_galois_keys();
+    cout << "Main: Galois keys are " << galois_keys.size() << " bytes" << endl;
 
     // Set galois key for client with id 0
     cout << "Main: Setting Galois keys..." << endl;
@@ -70,8 +65,7 @@ int main(int argc, char *argv[]) {
     // Measure database setup
     cout << "Main: pre processing database... " << endl;
     auto time_pre_s = high_resolution_clock::now();
-    server.set_database(move(db), number_of_items, size_per_item);
-    server.preprocess_database();
+    server.set_database(seeded_database(db_seed), number_of_items, size_per_item);
     auto time_pre_e = high_resolution_clock::now();
     auto time_pre_us = duration_cast<microseconds>(time_pre_e - time_pre_s).count();
     cout << "Main: database pre processed " << endl;
@@ -85,14 +79,18 @@ int main(int argc, char *argv[]) {
 
     // Measure query generation
     auto time_query_s = high_resolution_clock::now();
-    PirQuery query = client.generate_query(index);
+    string query_message = client.generate_serialized_query(index);
     auto time_query_e = high_resolution_clock::now();
     auto time_query_us = duration_cast<microseconds>(time_query_e - time_query_s).count();
-    cout << "Main: query generated" << endl;
+    cout << "Main: query generated, " << query_message.size() << " bytes" << endl;
+
+    // The query goes over the network in the wire format; the server expands
+    // the seeded ciphertexts when it reads it
+    PirQuery query = server.deserialize_query(query_message);
 
-    //To marshall query to send over the network, you can use serialize/deserialize:
-    //std::string query_ser = serialize_query(query);
-    //PirQuery query2 = deserialize_query(d, 1, query_ser, CIPHER_SIZE);
+    // Keep the per-phase breakdown of the reply
+    ReplyStats reply_stats;
+    server.set_reply_observer([&reply_stats](const ReplyStats &stats) { reply_stats = stats; });
 
     // Measure query processing (including expansion)
     auto time_server_s = high_resolution_clock::now();
@@ -106,18 +104,20 @@ int main(int argc, char *argv[]) {
     auto time_decode_e = chrono::high_resolution_clock::now();
     auto time_decode_us = duration_cast<microseconds>(time_decode_e - time_decode_s).count();
 
-    // Convert from FV plaintext (polynomial) to database element at the client
-    vector<uint8_t> elems(N * logt / 8);
-    coeffs_to_bytes(logt, result, elems.data(), (N * logt) / 8);
-
     // Check that we retrieved the correct element
-    for (uint32_t i = 0; i < size_per_item; i++) {
-        if (elems[(offset * size_per_item) + i] != db_copy.get()[(ele_index * size_per_item) + i]) {
-            cout << "Main: elems " << (int)elems[(offset * size_per_item) + i] << ", db "
-                 << (int) db_copy.get()[(ele_index * size_per_item) + i] << endl;
-            cout << "Main: PIR result wrong!" << endl;
-            return -1;
-        }
+    if (!check_seeded_element(params, result, db_seed, ele_index, offset, size_per_item)) {
+        cout << "Main: PIR result wrong!" << endl;
+        return -1;
+    }
+
+    // A second reply into the same PirReply runs on the warm workspace, so it
+    // must not allocate
+    size_t warm_bytes = server.workspace_bytes();
+    server.generate_reply(query, 0, reply);
+    if (server.workspace_bytes() > warm_bytes) {
+        cout << "Main: second reply grew the workspace from " << warm_bytes << " to "
+             << server.workspace_bytes() << " bytes" << endl;
+        return -1;
     }
 
     // Output results
@@ -126,8 +126,20 @@ int main(int argc, char *argv[]) {
     cout << "Main: PIRClient query generation time: " << time_query_us / 1000 << " ms" << endl;
     cout << "Main: PIRServer reply generation time: " << time_server_us / 1000 << " ms"
          << endl;
+    for (size_t i = 0; i < reply_stats.levels.size(); i++) {
+        const ReplyLevelStats &level = reply_stats.levels[i];
+        cout << "Main:   dimension " << i
+             << ": decomposition " << duration_cast<microseconds>(level.decomposition).count() / 1000
+             << " ms, expansion " << duration_cast<microseconds>(level.expansion).count() / 1000
+             << " ms, inner product " << duration_cast<microseconds>(level.inner_product).count() / 1000
+             << " ms, inverse NTT " << duration_cast<microseconds>(level.inverse_ntt).count() / 1000
+             << " ms" << endl;
+    }
+    cout << "Main:   Galois automorphisms: " << reply_stats.galois_applications
+         << ", plaintext multiplications: " << reply_stats.plain_multiplications << endl;
     cout << "Main: PIRClient answer decode time: " << time_decode_us / 1000 << " ms" << endl;
     cout << "Main: Reply num ciphertexts: " << reply.size() << endl;
+    cout << "Main: Reply size: " << serialize_ciphertexts(reply).size() << " bytes" << endl;
 
     return 0;
 }
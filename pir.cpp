@@ -1,4 +1,6 @@
 #include "pir.hpp"
+#include <algorithm>
+#include <cstring>
 
 using namespace std;
 using namespace seal;
@@ -32,37 +34,92 @@ vector<uint64_t> get_dimensions(uint64_t plaintext_num, uint32_t d) {
     return dimensions;
 }
 
-void gen_params(uint64_t ele_num, uint64_t ele_size, uint32_t N, uint32_t logt,
-                uint32_t d, EncryptionParameters &params,
-                PirParams &pir_params) {
-    
-    // Determine the maximum size of each dimension
-    uint64_t plaintext_num = plaintexts_per_db(logt, N, ele_num, ele_size);
-
-#ifdef DEBUG
-    cout << "log(plain mod) before expand = " << logt << endl;
-    cout << "number of FV plaintexts = " << plaintext_num << endl;
-#endif
+namespace {
 
+void set_encryption_params(uint32_t N, uint32_t logt, EncryptionParameters &params) {
     params.set_poly_modulus_degree(N);
     // TODO(kshehata): is this the correct way to do this?
     params.set_coeff_modulus(CoeffModulus::BFVDefault(N));
     params.set_plain_modulus(PlainModulus::Batching(N, logt));
+}
 
-    vector<uint64_t> nvec = get_dimensions(plaintext_num, d);
+// Bits the server packs into each plaintext coefficient: t has logt bits, so
+// floor(log2 t) = logt - 1 of them are always below t
+uint32_t plain_bits(const EncryptionParameters &params) {
+    return floor(log2(params.plain_modulus().value()));
+}
 
-    uint32_t expansion_ratio = 0;
-    for (uint32_t i = 0; i < params.coeff_modulus().size(); ++i) {
-        double logqi = log2(params.coeff_modulus()[i].value());
-        cout << "PIR: logqi = " << logqi << endl; 
-        expansion_ratio += ceil(logqi / logt);
+void set_pir_params(uint64_t ele_num, uint64_t ele_size, const vector<uint64_t> &nvec,
+                    const EncryptionParameters &params, PirParams &pir_params,
+                    bool mod_switch) {
+    uint64_t plaintext_num = plaintexts_per_db(plain_bits(params), params.poly_modulus_degree(),
+                                               ele_num, ele_size);
+    uint64_t product = 1;
+    for (auto n_i : nvec) {
+        if (n_i == 0) {
+            throw invalid_argument("dimensions must be nonzero");
+        }
+        product *= n_i;
+    }
+    if (nvec.empty() || product < plaintext_num) {
+        throw invalid_argument("dimensions do not cover the database");
     }
 
-    pir_params.d = d;
+    pir_params.d = nvec.size();
     pir_params.dbc = 6;
     pir_params.n = plaintext_num;
     pir_params.nvec = nvec;
-    pir_params.expansion_ratio = expansion_ratio << 1; // because one ciphertext = two polys
+    pir_params.expansion_ratio = compute_expansion_ratio(params, mod_switch);
+    pir_params.mod_switch = mod_switch;
+}
+
+} // namespace
+
+void gen_params(uint64_t ele_num, uint64_t ele_size, uint32_t N, uint32_t logt,
+                uint32_t d, EncryptionParameters &params,
+                PirParams &pir_params, bool mod_switch) {
+
+    set_encryption_params(N, logt, params);
+
+    // Determine the maximum size of each dimension
+    uint64_t plaintext_num = plaintexts_per_db(plain_bits(params), N, ele_num, ele_size);
+
+    PIR_LOG(LogLevel::debug, "log(plain mod) before expand = " << logt);
+    PIR_LOG(LogLevel::debug, "number of FV plaintexts = " << plaintext_num);
+
+    set_pir_params(ele_num, ele_size, get_dimensions(plaintext_num, d), params, pir_params,
+                   mod_switch);
+}
+
+void gen_params(uint64_t ele_num, uint64_t ele_size, uint32_t N, uint32_t logt,
+                const vector<uint64_t> &nvec, EncryptionParameters &params,
+                PirParams &pir_params, bool mod_switch) {
+
+    set_encryption_params(N, logt, params);
+    set_pir_params(ele_num, ele_size, nvec, params, pir_params, mod_switch);
+}
+
+vector<Modulus> reply_coeff_modulus(const EncryptionParameters &params, bool mod_switch) {
+    // Each step of the modulus switching chain drops the last remaining prime
+    vector<Modulus> moduli = params.coeff_modulus();
+    if (mod_switch) {
+        moduli.resize(1);
+    } else if (moduli.size() > 1) {
+        moduli.pop_back();
+    }
+    return moduli;
+}
+
+uint32_t compute_expansion_ratio(const EncryptionParameters &params, bool mod_switch) {
+    int logt = floor(log2(params.plain_modulus().value()));
+
+    uint32_t expansion_ratio = 0;
+    for (const auto &modulus : reply_coeff_modulus(params, mod_switch)) {
+        double logqi = log2(modulus.value());
+        PIR_LOG(LogLevel::debug, "PIR: logqi = " << logqi);
+        expansion_ratio += ceil(logqi / logt);
+    }
+    return expansion_ratio << 1; // because one ciphertext = two polys
 }
 
 
@@ -107,54 +164,66 @@ uint64_t plaintexts_per_db(uint32_t logtp, uint64_t N, uint64_t ele_num, uint64_
     return ceil((double)ele_num / ele_per_ptxt);
 }
 
-vector<uint64_t> bytes_to_coeffs(uint32_t limit, const uint8_t *bytes, uint64_t size) {
+namespace {
 
-    uint64_t size_out = coefficients_per_element(limit, size);
-    vector<uint64_t> output(size_out);
+typedef unsigned __int128 uint128_t;
 
-    uint32_t room = limit;
-    uint64_t *target = &output[0];
+// Bytes i..i+7 as a big-endian word
+inline uint64_t load_be64(const uint8_t *bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    return __builtin_bswap64(word);
+}
 
-    for (uint32_t i = 0; i < size; i++) {
-        uint8_t src = bytes[i];
-        uint32_t rest = 8;
-        while (rest) {
-            if (room == 0) {
-                target++;
-                room = limit;
-            }
-            uint32_t shift = rest;
-            if (room < rest) {
-                shift = room;
-            }
-            *target = *target << shift;
-            *target = *target | (src >> (8 - shift));
-            src = src << shift;
-            room -= shift;
-            rest -= shift;
+inline void store_be64(uint8_t *bytes, uint64_t word) {
+    word = __builtin_bswap64(word);
+    memcpy(bytes, &word, 8);
+}
+
+// Any limit up to 64 bits. The bits of the bytes are taken in order from the
+// most significant, eight bytes at a time, and the last coefficient is padded
+// with zero bits.
+uint64_t pack_bits(uint32_t limit, const uint8_t *bytes, uint64_t size, uint64_t *coeffs) {
+    uint128_t acc = 0; // the low `bits` bits are pending
+    uint32_t bits = 0;
+    uint64_t n = 0;
+    uint64_t mask = (limit == 64) ? ~uint64_t(0) : (uint64_t(1) << limit) - 1;
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        acc = (acc << 64) | load_be64(bytes + i);
+        bits += 64;
+        while (bits >= limit) {
+            bits -= limit;
+            coeffs[n++] = static_cast<uint64_t>(acc >> bits) & mask;
         }
     }
-
-    *target = *target << room;
-    return output;
+    for (; i < size; i++) {
+        acc = (acc << 8) | bytes[i];
+        bits += 8;
+        while (bits >= limit) {
+            bits -= limit;
+            coeffs[n++] = static_cast<uint64_t>(acc >> bits) & mask;
+        }
+    }
+    if (bits > 0) {
+        coeffs[n++] = static_cast<uint64_t>(acc << (limit - bits)) & mask;
+    }
+    return n;
 }
 
-void coeffs_to_bytes(uint32_t limit, const Plaintext &coeffs, uint8_t *output, uint32_t size_out) {
+// The original bit-at-a-time loop, kept for limits below 8 where one byte
+// takes pieces of several coefficients
+void unpack_small(uint32_t limit, const uint64_t *coeffs, uint64_t count, uint8_t *output,
+                  uint64_t size_out) {
     uint32_t room = 8;
-    uint32_t j = 0;
-    uint8_t *target = output;
-
-    for (uint32_t i = 0; i < coeffs.coeff_count(); i++) {
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < count; i++) {
         uint64_t src = coeffs[i];
         uint32_t rest = limit;
         while (rest && j < size_out) {
-            uint32_t shift = rest;
-            if (room < rest) {
-                shift = room;
-            }
-            target[j] = target[j] << shift;
-            target[j] = target[j] | (src >> (limit - shift));
-            src = src << shift;
+            uint32_t shift = min(room, rest);
+            output[j] = (output[j] << shift) | (src >> (limit - shift));
+            src <<= shift;
             room -= shift;
             rest -= shift;
             if (room == 0) {
@@ -165,6 +234,147 @@ void coeffs_to_bytes(uint32_t limit, const Plaintext &coeffs, uint8_t *output, u
     }
 }
 
+// Inverse of the above, for coefficients below 2^limit. Stops after size_out
+// bytes. If the coefficients end inside a byte, that byte is set as by the
+// bit-at-a-time loop this replaces: its old value shifted left, or-ed with
+// the last coefficient as that loop had shifted it.
+void unpack_bits(uint32_t limit, const uint64_t *coeffs, uint64_t count, uint8_t *output,
+                 uint64_t size_out) {
+    if (limit < 8) {
+        unpack_small(limit, coeffs, count, output, size_out);
+        return;
+    }
+    uint128_t acc = 0;
+    uint32_t bits = 0;
+    uint64_t j = 0;
+    for (uint64_t i = 0; i < count && j < size_out; i++) {
+        acc = (acc << limit) | coeffs[i];
+        bits += limit;
+        if (j + 8 <= size_out) {
+            // Eight bytes at a time while they fit
+            if (bits >= 64) {
+                bits -= 64;
+                store_be64(output + j, static_cast<uint64_t>(acc >> bits));
+                j += 8;
+            }
+            continue;
+        }
+        while (bits >= 8 && j < size_out) {
+            bits -= 8;
+            output[j++] = static_cast<uint8_t>(acc >> bits);
+        }
+    }
+    while (bits >= 8 && j < size_out) {
+        bits -= 8;
+        output[j++] = static_cast<uint8_t>(acc >> bits);
+    }
+    if (bits > 0 && j < size_out) {
+        // Only the last coefficient reaches into this byte, since limit >= 8
+        uint32_t consumed = limit - bits;
+        uint64_t src = (coeffs[count - 1] << consumed) >> consumed;
+        output[j] = static_cast<uint8_t>((uint64_t(output[j]) << bits) | src);
+    }
+}
+
+// Common limits a group at a time: `group` bytes hold exactly `per_group`
+// coefficients, so each group is a fixed sequence of shifts on one word that
+// the compiler unrolls (and vectorizes for 8 and 16 bits). The tail that does
+// not fill a group goes through the generic loop, which starts on a
+// coefficient and byte boundary.
+template <uint32_t L>
+struct BitGroup {
+    static constexpr uint32_t gcd8 = (L % 8 == 0) ? 8 : (L % 4 == 0) ? 4 : (L % 2 == 0) ? 2 : 1;
+    static constexpr uint32_t group = L / gcd8;     // bytes
+    static constexpr uint32_t per_group = 8 / gcd8; // coefficients
+    static_assert(group <= 8, "a group must fit in a word");
+};
+
+template <uint32_t L>
+uint64_t pack_groups(const uint8_t *bytes, uint64_t size, uint64_t *coeffs) {
+    constexpr uint32_t group = BitGroup<L>::group;
+    constexpr uint32_t per_group = BitGroup<L>::per_group;
+    constexpr uint64_t mask = (uint64_t(1) << L) - 1;
+
+    uint64_t groups = size / group;
+    for (uint64_t g = 0; g < groups; g++) {
+        const uint8_t *in = bytes + g * group;
+        uint64_t word = 0;
+        for (uint32_t b = 0; b < group; b++) {
+            word = (word << 8) | in[b];
+        }
+        uint64_t *out = coeffs + g * per_group;
+        for (uint32_t c = 0; c < per_group; c++) {
+            out[c] = (word >> (L * (per_group - 1 - c))) & mask;
+        }
+    }
+    return groups * per_group + pack_bits(L, bytes + groups * group, size - groups * group,
+                                          coeffs + groups * per_group);
+}
+
+template <uint32_t L>
+void unpack_groups(const uint64_t *coeffs, uint64_t count, uint8_t *output, uint64_t size_out) {
+    constexpr uint32_t group = BitGroup<L>::group;
+    constexpr uint32_t per_group = BitGroup<L>::per_group;
+
+    uint64_t groups = min(count / per_group, size_out / group);
+    for (uint64_t g = 0; g < groups; g++) {
+        const uint64_t *in = coeffs + g * per_group;
+        uint64_t word = 0;
+        for (uint32_t c = 0; c < per_group; c++) {
+            word = (word << L) | in[c];
+        }
+        uint8_t *out = output + g * group;
+        for (uint32_t b = 0; b < group; b++) {
+            out[b] = static_cast<uint8_t>(word >> (8 * (group - 1 - b)));
+        }
+    }
+    unpack_bits(L, coeffs + groups * per_group, count - groups * per_group,
+                output + groups * group, size_out - groups * group);
+}
+
+} // namespace
+
+uint64_t bytes_to_coeffs(uint32_t limit, const uint8_t *bytes, uint64_t size, uint64_t *coeffs) {
+    switch (limit) {
+    case 8:
+        return pack_groups<8>(bytes, size, coeffs);
+    case 12:
+        return pack_groups<12>(bytes, size, coeffs);
+    case 16:
+        return pack_groups<16>(bytes, size, coeffs);
+    case 20:
+        return pack_groups<20>(bytes, size, coeffs);
+    default:
+        return pack_bits(limit, bytes, size, coeffs);
+    }
+}
+
+vector<uint64_t> bytes_to_coeffs(uint32_t limit, const uint8_t *bytes, uint64_t size) {
+    vector<uint64_t> output(coefficients_per_element(limit, size));
+    bytes_to_coeffs(limit, bytes, size, output.data());
+    return output;
+}
+
+void coeffs_to_bytes(uint32_t limit, const uint64_t *coeffs, uint64_t count, uint8_t *output,
+                     uint64_t size_out) {
+    switch (limit) {
+    case 8:
+        return unpack_groups<8>(coeffs, count, output, size_out);
+    case 12:
+        return unpack_groups<12>(coeffs, count, output, size_out);
+    case 16:
+        return unpack_groups<16>(coeffs, count, output, size_out);
+    case 20:
+        return unpack_groups<20>(coeffs, count, output, size_out);
+    default:
+        return unpack_bits(limit, coeffs, count, output, size_out);
+    }
+}
+
+void coeffs_to_bytes(uint32_t limit, const Plaintext &coeffs, uint8_t *output, uint32_t size_out) {
+    coeffs_to_bytes(limit, coeffs.data(), coeffs.coeff_count(), output, size_out);
+}
+
 void vector_to_plaintext(const vector<uint64_t> &coeffs, Plaintext &plain) {
     uint32_t coeff_count = coeffs.size();
     plain.resize(coeff_count);
@@ -194,20 +404,32 @@ vector<uint64_t> compute_indices(uint64_t desiredIndex, vector<uint64_t> Nvec) {
     return result;
 }
 
+uint32_t expansion_depth(uint64_t m, uint64_t leaf) {
+    // Level i splits node a = leaf mod 2^i only if its second child a + 2^i
+    // is below m
+    uint32_t depth = 0;
+    for (uint64_t size = 1; size < m; size <<= 1) {
+        if (leaf % size + size < m) {
+            depth++;
+        }
+    }
+    return depth;
+}
+
 inline Ciphertext deserialize_ciphertext(
-    std::shared_ptr<SEALContext> context, string s) {
+    std::shared_ptr<SEALContext> context, string_view s) {
     Ciphertext c;
-    std::istringstream input(s);
-    c.unsafe_load(context, input);
+    c.unsafe_load(context, reinterpret_cast<const SEAL_BYTE *>(s.data()), s.size());
     return c;
 }
 
 
 vector<Ciphertext> deserialize_ciphertexts(
-    std::shared_ptr<SEALContext> context, uint32_t count, string s,
+    std::shared_ptr<SEALContext> context, uint32_t count, string_view s,
     uint32_t len_ciphertext) {
 
     vector<Ciphertext> c;
+    c.reserve(count);
     for (uint32_t i = 0; i < count; i++) {
         c.push_back(deserialize_ciphertext(context, s.substr(i * len_ciphertext, len_ciphertext)));
     }
@@ -215,9 +437,10 @@ vector<Ciphertext> deserialize_ciphertexts(
 }
 
 PirQuery deserialize_query(std::shared_ptr<SEALContext> context,
-    uint32_t d, uint32_t count, string s, uint32_t len_ciphertext) {
+    uint32_t d, uint32_t count, string_view s, uint32_t len_ciphertext) {
 
     vector<vector<Ciphertext>> c;
+    c.reserve(d);
     for (uint32_t i = 0; i < d; i++) {
         c.push_back(deserialize_ciphertexts(
               context,
@@ -229,42 +452,197 @@ PirQuery deserialize_query(std::shared_ptr<SEALContext> context,
     return c;
 }
 
-
-inline string serialize_ciphertext(Ciphertext c) {
-    std::ostringstream output;
-    c.save(output);
-    return output.str();
+void serialize_ciphertexts(const vector<Ciphertext> &c, string &out) {
+    for (const auto &ciphertext : c) {
+        append_seal_object(out, ciphertext);
+    }
 }
 
-string serialize_ciphertexts(vector<Ciphertext> c) {
+string serialize_ciphertexts(const vector<Ciphertext> &c) {
     string s;
-    for (uint32_t i = 0; i < c.size(); i++) {
-        s.append(serialize_ciphertext(c[i]));
-    }
+    serialize_ciphertexts(c, s);
     return s;
 }
 
-string serialize_query(vector<vector<Ciphertext>> c) {
-    string s;
-    for (uint32_t i = 0; i < c.size(); i++) {
-      for (uint32_t j = 0; j < c[i].size(); j++) {
-        s.append(serialize_ciphertext(c[i][j]));
-      }
+void serialize_query(const PirQuery &c, string &out) {
+    for (const auto &dimension : c) {
+        serialize_ciphertexts(dimension, out);
     }
+}
+
+string serialize_query(const PirQuery &c) {
+    string s;
+    serialize_query(c, s);
     return s;
 }
 
-string serialize_galoiskeys(GaloisKeys g) {
-    std::ostringstream output;
-    g.save(output);
-    return output.str();
+string serialize_galoiskeys(const GaloisKeys &g) {
+    string s;
+    append_seal_object(s, g);
+    return s;
 }
 
 GaloisKeys *deserialize_galoiskeys(
-    std::shared_ptr<SEALContext> context, string s) {
+    std::shared_ptr<SEALContext> context, string_view s) {
 
     GaloisKeys *g = new GaloisKeys();
-    std::istringstream input(s);
-    g->unsafe_load(context, input);
+    g->unsafe_load(context, reinterpret_cast<const SEAL_BYTE *>(s.data()), s.size());
     return g;
 }
+
+void write_wire_u32(string &out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+void write_wire_header(string &out, WireKind kind) {
+    write_wire_u32(out, PIR_WIRE_MAGIC);
+    out.push_back(static_cast<char>(PIR_WIRE_VERSION));
+    out.push_back(static_cast<char>(kind));
+}
+
+void serialize_query_message(const PirQuery &query, string &out) {
+    write_wire_header(out, WireKind::query);
+    write_wire_u32(out, query.size());
+    for (const auto &dimension : query) {
+        write_wire_u32(out, dimension.size());
+        for (const auto &ciphertext : dimension) {
+            write_wire_object(out, ciphertext);
+        }
+    }
+}
+
+string serialize_query_message(const PirQuery &query) {
+    string s;
+    serialize_query_message(query, s);
+    return s;
+}
+
+string serialize_galoiskeys_message(const GaloisKeys &keys) {
+    string s;
+    write_wire_header(s, WireKind::galois_keys);
+    write_wire_object(s, keys);
+    return s;
+}
+
+void serialize_reply_message(const PirReply &reply, string &out) {
+    write_wire_header(out, WireKind::reply);
+    write_wire_u32(out, reply.size());
+    for (const auto &ciphertext : reply) {
+        write_wire_object(out, ciphertext);
+    }
+}
+
+namespace {
+
+// Reads a message written with the functions above, checking every length
+// against what is left. Objects are loaded straight from the message bytes.
+class WireReader {
+  public:
+    WireReader(string_view message, WireKind kind) : message_(message), pos_(0) {
+        if (read_u32() != PIR_WIRE_MAGIC) {
+            throw invalid_argument("not a PIR message");
+        }
+        if (read_byte() != PIR_WIRE_VERSION) {
+            throw invalid_argument("unsupported PIR message version");
+        }
+        if (read_byte() != static_cast<uint8_t>(kind)) {
+            throw invalid_argument("unexpected PIR message kind");
+        }
+    }
+
+    uint32_t read_u32() {
+        need(4);
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(message_[pos_ + i])) << (8 * i);
+        }
+        pos_ += 4;
+        return value;
+    }
+
+    template <class T>
+    void read_object(shared_ptr<SEALContext> context, T &object) {
+        uint32_t size = read_u32();
+        need(size);
+        // load validates the object and expands a seeded random half. It
+        // reports a corrupt body as logic_error or runtime_error, which
+        // become invalid_argument like every other malformed message.
+        try {
+            object.load(context, reinterpret_cast<const SEAL_BYTE *>(message_.data() + pos_),
+                        size);
+        } catch (const exception &e) {
+            throw invalid_argument(string("invalid SEAL object in PIR message: ") + e.what());
+        }
+        pos_ += size;
+    }
+
+    void finish() const {
+        if (pos_ != message_.size()) {
+            throw invalid_argument("trailing bytes in PIR message");
+        }
+    }
+
+  private:
+    string_view message_;
+    size_t pos_;
+
+    uint8_t read_byte() {
+        need(1);
+        return static_cast<uint8_t>(message_[pos_++]);
+    }
+
+    void need(size_t bytes) const {
+        if (message_.size() - pos_ < bytes) {
+            throw invalid_argument("truncated PIR message");
+        }
+    }
+};
+
+} // namespace
+
+PirQuery deserialize_query_message(shared_ptr<SEALContext> context, string_view message) {
+    WireReader reader(message, WireKind::query);
+    // Every count and ciphertext takes at least four bytes, which bounds
+    // what a malformed message can make us allocate
+    uint32_t d = reader.read_u32();
+    if (d > message.size() / 4) {
+        throw invalid_argument("truncated PIR message");
+    }
+    PirQuery query(d);
+    for (auto &dimension : query) {
+        uint32_t count = reader.read_u32();
+        if (count > message.size() / 4) {
+            throw invalid_argument("truncated PIR message");
+        }
+        dimension.resize(count);
+        for (auto &ciphertext : dimension) {
+            reader.read_object(context, ciphertext);
+        }
+    }
+    reader.finish();
+    return query;
+}
+
+GaloisKeys deserialize_galoiskeys_message(shared_ptr<SEALContext> context, string_view message) {
+    WireReader reader(message, WireKind::galois_keys);
+    GaloisKeys keys;
+    reader.read_object(context, keys);
+    reader.finish();
+    return keys;
+}
+
+PirReply deserialize_reply_message(shared_ptr<SEALContext> context, string_view message) {
+    WireReader reader(message, WireKind::reply);
+    uint32_t count = reader.read_u32();
+    if (count > message.size() / 4) {
+        throw invalid_argument("truncated PIR message");
+    }
+    PirReply reply(count);
+    for (auto &ciphertext : reply) {
+        reader.read_object(context, ciphertext);
+    }
+    reader.finish();
+    return reply;
+}
@@ -1,12 +1,17 @@
 #pragma once
 
+#include "pir_trace.hpp"
 #include "seal/seal.h"
 #include "seal/util/polyarithsmallmod.h"
 #include <cassert>
 #include <cmath>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// Size of a ciphertext in the fixed-size format of deserialize_query, for the
+// default parameters of main.cpp. The wire format below does not need it.
 #define CIPHER_SIZE 32841
 
 using seal::SEALContext;
@@ -21,6 +26,7 @@ struct PirParams {
     std::uint32_t expansion_ratio;   // ratio of ciphertext to plaintext
     std::uint32_t dbc;               // decomposition bit count (used by relinearization)
     std::vector<std::uint64_t> nvec; // size of each of the d dimensions
+    bool mod_switch;                 // replies are switched to the last (smallest) modulus
 };
 
 void gen_params(std::uint64_t ele_num,  // number of elements (not FV plaintexts) in database
@@ -29,7 +35,36 @@ void gen_params(std::uint64_t ele_num,  // number of elements (not FV plaintexts
                 std::uint32_t logt,     // bits of plaintext coefficient
                 std::uint32_t d,        // dimension of database
                 seal::EncryptionParameters &params,
-                PirParams &pir_params);
+                PirParams &pir_params,
+                bool mod_switch = false); // see PirParams::mod_switch
+
+// As above, with the size of each dimension given instead of a balanced split
+// into d dimensions; their product must cover the database
+void gen_params(std::uint64_t ele_num,
+                std::uint64_t ele_size,
+                std::uint32_t N,
+                std::uint32_t logt,
+                const std::vector<std::uint64_t> &nvec,
+                seal::EncryptionParameters &params,
+                PirParams &pir_params,
+                bool mod_switch = false);
+
+// With mod_switch, the server switches every result ciphertext down to the
+// last level of the modulus chain, which keeps only the first prime of
+// coeff_modulus, before it returns it or decomposes it for the next
+// dimension. Replies are then smaller and each level of the reply has fewer
+// ciphertexts, at the cost of the noise budget that switching consumes.
+
+// Coefficient moduli of the ciphertexts in a reply: those of the query's
+// level (all but the special prime SEAL keeps for key switching), or only the
+// first prime with mod_switch
+std::vector<seal::Modulus> reply_coeff_modulus(const seal::EncryptionParameters &params,
+                                               bool mod_switch);
+
+// Number of plaintexts a reply ciphertext is decomposed into: every
+// coefficient is cut into floor(log2 t)-bit digits, so each digit is below t
+std::uint32_t compute_expansion_ratio(const seal::EncryptionParameters &params,
+                                      bool mod_switch);
 
 // returns the plaintext modulus after expansion
 std::uint32_t plainmod_after_expansion(std::uint32_t logt, std::uint32_t N, 
@@ -55,6 +90,16 @@ std::vector<std::uint64_t> bytes_to_coeffs(std::uint32_t limit, const std::uint8
 void coeffs_to_bytes(std::uint32_t logtp, const seal::Plaintext &coeffs, std::uint8_t *output,
                      std::uint32_t size_out);
 
+// In-place forms of the two above, e.g. on a Plaintext's data(). They move
+// whole words at a time, with unrolled kernels for limits of 8, 12, 16 and 20
+// bits, and give the same result as the bit-at-a-time loops they replaced for
+// coefficients below 2^limit. bytes_to_coeffs writes and returns
+// coefficients_per_element(limit, size) coefficients.
+std::uint64_t bytes_to_coeffs(std::uint32_t limit, const std::uint8_t *bytes, std::uint64_t size,
+                              std::uint64_t *coeffs);
+void coeffs_to_bytes(std::uint32_t limit, const std::uint64_t *coeffs, std::uint64_t count,
+                     std::uint8_t *output, std::uint64_t size_out);
+
 // Takes a vector of coefficients and returns the corresponding FV plaintext
 void vector_to_plaintext(const std::vector<std::uint64_t> &coeffs, seal::Plaintext &plain);
 
@@ -64,20 +109,89 @@ void vector_to_plaintext(const std::vector<std::uint64_t> &coeffs, seal::Plainte
 std::vector<std::uint64_t> compute_indices(std::uint64_t desiredIndex,
                                            std::vector<std::uint64_t> nvec);
 
-// Serialize and deserialize ciphertexts to send them over the network
+// The number of doublings leaf goes through when a query ctxt is expanded
+// into m ctxts, i.e. the leaf holds 2^depth times the query coefficient.
+// Levels that would only create leaves past m are skipped, so leaves whose
+// sibling is past m are one doubling short.
+std::uint32_t expansion_depth(std::uint64_t m, std::uint64_t leaf);
+
+// Appends a SEAL object, or a seeded Serializable of one, to out. The object
+// is saved straight into out's buffer; returns the bytes written.
+template <class T>
+std::size_t append_seal_object(std::string &out, const T &object) {
+    std::size_t offset = out.size();
+    out.resize(offset + static_cast<std::size_t>(object.save_size()));
+    auto size = object.save(reinterpret_cast<seal::SEAL_BYTE *>(&out[offset]), out.size() - offset);
+    out.resize(offset + static_cast<std::size_t>(size));
+    return static_cast<std::size_t>(size);
+}
+
+// Serialize and deserialize ciphertexts to send them over the network. The
+// deserializers read the ciphertexts in place from s, which can view a
+// network buffer; the serializers with an out argument append to it, so a
+// caller can reuse one buffer for many messages.
 PirQuery deserialize_query(std::shared_ptr<SEALContext> context,
-  std::uint32_t d, uint32_t count, std::string s,
+  std::uint32_t d, uint32_t count, std::string_view s,
   std::uint32_t len_ciphertext);
 
 std::vector<seal::Ciphertext> deserialize_ciphertexts(
     std::shared_ptr<SEALContext> context,
-    std::uint32_t count, std::string s,
+    std::uint32_t count, std::string_view s,
     std::uint32_t len_ciphertext);
 
-std::string serialize_ciphertexts(std::vector<seal::Ciphertext> c);
-std::string serialize_query(std::vector<std::vector<seal::Ciphertext>> c);
+std::string serialize_ciphertexts(const std::vector<seal::Ciphertext> &c);
+void serialize_ciphertexts(const std::vector<seal::Ciphertext> &c, std::string &out);
+std::string serialize_query(const PirQuery &c);
+void serialize_query(const PirQuery &c, std::string &out);
 
 // Serialize and deserialize galois keys to send them over the network
-std::string serialize_galoiskeys(seal::GaloisKeys g);
+std::string serialize_galoiskeys(const seal::GaloisKeys &g);
 seal::GaloisKeys *deserialize_galoiskeys(
-  std::shared_ptr<SEALContext> context, std::string s);
+  std::shared_ptr<SEALContext> context, std::string_view s);
+
+// Wire format for queries and Galois keys. A message starts with a magic
+// number, the format version and the kind of message; every SEAL object in it
+// is prefixed with its length, so ciphertexts need not have a fixed size. All
+// integers are little endian.
+//
+//   query:        header, d, then for each dimension a count and the ciphertexts
+//   Galois keys:  header, then the keys
+//   reply:        header, a count and the ciphertexts
+//
+// Objects are saved with SEAL's default compression. Queries and keys made
+// with the secret key (PIRClient::generate_serialized_query and
+// generate_serialized_galois_keys) are saved with a seed in place of their
+// uniformly random half, which the deserializers expand again.
+constexpr std::uint32_t PIR_WIRE_MAGIC = 0x52495053; // "SPIR"
+constexpr std::uint8_t PIR_WIRE_VERSION = 1;
+
+enum class WireKind : std::uint8_t { query = 1, galois_keys = 2, reply = 3 };
+
+void write_wire_header(std::string &out, WireKind kind);
+void write_wire_u32(std::string &out, std::uint32_t value);
+
+// Appends a SEAL object, or a seeded Serializable of one, with its length
+template <class T>
+void write_wire_object(std::string &out, const T &object) {
+    std::size_t prefix = out.size();
+    write_wire_u32(out, 0);
+    std::size_t size = append_seal_object(out, object);
+    for (int i = 0; i < 4; i++) {
+        out[prefix + i] = static_cast<char>(size >> (8 * i));
+    }
+}
+
+std::string serialize_query_message(const PirQuery &query);
+void serialize_query_message(const PirQuery &query, std::string &out);
+std::string serialize_galoiskeys_message(const seal::GaloisKeys &keys);
+void serialize_reply_message(const PirReply &reply, std::string &out);
+
+// Read the objects straight from message, and throw invalid_argument if it is
+// malformed, of another kind or version, or holds objects that are not valid
+// for the context
+PirQuery deserialize_query_message(std::shared_ptr<SEALContext> context,
+                                   std::string_view message);
+seal::GaloisKeys deserialize_galoiskeys_message(std::shared_ptr<SEALContext> context,
+                                                std::string_view message);
+PirReply deserialize_reply_message(std::shared_ptr<SEALContext> context,
+                                   std::string_view message);
@@ -0,0 +1,255 @@
+#include "pir_batch.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+using namespace seal;
+
+namespace {
+
+constexpr uint32_t default_num_hashes = 3;
+constexpr uint64_t default_seed = 0x5eedba7c4b1dULL;
+
+// Evictions before cuckoo placement gives up
+constexpr uint32_t max_evictions = 1000;
+
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// The distinct buckets of an element: successive hashes of (seed, element),
+// skipping repeats
+void element_buckets(const BatchParams &batch_params, uint64_t element, uint32_t *buckets) {
+    uint64_t state = splitmix64(batch_params.seed ^ splitmix64(element));
+    for (uint32_t j = 0; j < batch_params.num_hashes;) {
+        state = splitmix64(state);
+        uint32_t bucket = static_cast<uint32_t>(state % batch_params.num_buckets);
+        if (find(buckets, buckets + j, bucket) == buckets + j) {
+            buckets[j++] = bucket;
+        }
+    }
+}
+
+} // namespace
+
+void gen_batch_params(uint64_t ele_num, uint64_t ele_size, uint32_t max_batch, uint32_t N,
+                      uint32_t logt, uint32_t d, EncryptionParameters &params,
+                      PirParams &pir_params, BatchParams &batch_params, bool mod_switch) {
+    if (ele_num == 0 || max_batch == 0) {
+        throw invalid_argument("database and batch must be nonempty");
+    }
+
+    batch_params.ele_num = ele_num;
+    batch_params.ele_size = ele_size;
+    batch_params.max_batch = max_batch;
+    batch_params.num_buckets = max<uint32_t>(2, (3 * max_batch + 1) / 2);
+    batch_params.num_hashes = min(default_num_hashes, batch_params.num_buckets);
+    batch_params.seed = default_seed;
+
+    // Bucket sizes are a function of the public parameters alone
+    vector<uint64_t> counts(batch_params.num_buckets, 0);
+    vector<uint32_t> buckets(batch_params.num_hashes);
+    for (uint64_t e = 0; e < ele_num; e++) {
+        element_buckets(batch_params, e, buckets.data());
+        for (auto b : buckets) {
+            counts[b]++;
+        }
+    }
+    batch_params.bucket_size = *max_element(counts.begin(), counts.end());
+
+    gen_params(batch_params.bucket_size, ele_size, N, logt, d, params, pir_params, mod_switch);
+}
+
+BatchLayout::BatchLayout(const BatchParams &batch_params) :
+    batch_params_(batch_params),
+    elements_(batch_params.num_buckets)
+{
+    vector<uint32_t> buckets(batch_params_.num_hashes);
+    for (uint64_t e = 0; e < batch_params_.ele_num; e++) {
+        element_buckets(batch_params_, e, buckets.data());
+        for (auto b : buckets) {
+            elements_[b].push_back(e);
+        }
+    }
+}
+
+void BatchLayout::buckets(uint64_t element, uint32_t *buckets) const {
+    element_buckets(batch_params_, element, buckets);
+}
+
+uint64_t BatchLayout::position(uint64_t element, uint32_t bucket) const {
+    const auto &elements = elements_[bucket];
+    auto it = lower_bound(elements.begin(), elements.end(), element);
+    if (it == elements.end() || *it != element) {
+        throw invalid_argument("element is not in this bucket");
+    }
+    return it - elements.begin();
+}
+
+PIRBatchServer::PIRBatchServer(const EncryptionParameters &params, const PirParams &pir_params,
+                               const BatchParams &batch_params) :
+    batch_params_(batch_params),
+    layout_(batch_params)
+{
+    for (uint32_t b = 0; b < batch_params_.num_buckets; b++) {
+        buckets_.push_back(make_unique<PIRServer>(params, pir_params));
+        if (b > 0) {
+            buckets_[b]->set_galois_key_store(buckets_[0]->galois_key_store());
+        }
+    }
+    workers_ = make_unique<ThreadPool>(1);
+}
+
+void PIRBatchServer::set_database(const unique_ptr<const uint8_t[]> &bytes) {
+    uint64_t ele_size = batch_params_.ele_size;
+
+    workers_->parallel_for(buckets_.size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t b = begin; b < end; b++) {
+            // The bucket's elements in order, then zeros up to bucket_size
+            const auto &elements = layout_.elements(b);
+            uint64_t offset = 0;
+            auto read_chunk = [&](uint8_t *buffer, uint64_t size) {
+                while (size > 0) {
+                    uint64_t e = offset / ele_size;
+                    uint64_t within = offset % ele_size;
+                    uint64_t count = min(size, ele_size - within);
+                    if (e < elements.size()) {
+                        memcpy(buffer, bytes.get() + elements[e] * ele_size + within, count);
+                    } else {
+                        memset(buffer, 0, count);
+                    }
+                    buffer += count;
+                    offset += count;
+                    size -= count;
+                }
+            };
+            buckets_[b]->set_database(read_chunk, batch_params_.bucket_size, ele_size);
+        }
+    });
+}
+
+void PIRBatchServer::set_galois_key(uint32_t client_id, GaloisKeys galkey) {
+    buckets_[0]->set_galois_key(client_id, move(galkey));
+}
+
+void PIRBatchServer::set_galois_key(uint32_t client_id, string_view message) {
+    buckets_[0]->set_galois_key(client_id, message);
+}
+
+void PIRBatchServer::set_num_threads(uint32_t num_threads) {
+    workers_ = make_unique<ThreadPool>(num_threads);
+}
+
+vector<PirReply> PIRBatchServer::generate_reply(const vector<PirQuery> &queries,
+                                                uint32_t client_id) {
+    if (queries.size() != buckets_.size()) {
+        throw invalid_argument("batch query must have one query per bucket");
+    }
+
+    // Buckets are answered in parallel, each on a single thread, which
+    // splits the work evenly without nesting parallel loops
+    vector<PirReply> replies(buckets_.size());
+    workers_->parallel_for(buckets_.size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t b = begin; b < end; b++) {
+            buckets_[b]->generate_reply(queries[b], client_id, replies[b], 1);
+        }
+    });
+    return replies;
+}
+
+PIRBatchClient::PIRBatchClient(const EncryptionParameters &params, const PirParams &pir_params,
+                               const BatchParams &batch_params) :
+    params_(params),
+    batch_params_(batch_params),
+    layout_(batch_params),
+    client_(params, pir_params),
+    rng_(random_device()())
+{}
+
+GaloisKeys PIRBatchClient::generate_galois_keys() {
+    return client_.generate_galois_keys();
+}
+
+string PIRBatchClient::generate_serialized_galois_keys() {
+    return client_.generate_serialized_galois_keys();
+}
+
+vector<PirQuery> PIRBatchClient::generate_query(const vector<uint64_t> &elements) {
+    if (elements.size() > batch_params_.max_batch) {
+        throw invalid_argument("more elements than the batch size");
+    }
+    for (auto e : elements) {
+        if (e >= batch_params_.ele_num) {
+            throw invalid_argument("element index out of range");
+        }
+    }
+
+    // Cuckoo placement: an element goes to a free bucket of its own, or
+    // evicts the occupant of a random one, which then moves on in turn
+    uint32_t num_buckets = batch_params_.num_buckets;
+    uint32_t num_hashes = batch_params_.num_hashes;
+    vector<int64_t> occupant(num_buckets, -1);
+    vector<uint32_t> buckets(num_hashes);
+    for (size_t i = 0; i < elements.size(); i++) {
+        int64_t current = i;
+        uint32_t evictions = 0;
+        while (current >= 0) {
+            layout_.buckets(elements[current], buckets.data());
+            auto free_bucket = find_if(buckets.begin(), buckets.end(),
+                                       [&](uint32_t b) { return occupant[b] < 0; });
+            if (free_bucket != buckets.end()) {
+                occupant[*free_bucket] = current;
+                current = -1;
+            } else if (evictions++ == max_evictions) {
+                throw runtime_error("cannot place the elements in buckets");
+            } else {
+                uint32_t b = buckets[rng_() % num_hashes];
+                swap(occupant[b], current);
+            }
+        }
+    }
+
+    // Every bucket gets a query; empty ones ask for their first plaintext
+    placement_.assign(elements.size(), make_pair(0u, uint64_t(0)));
+    vector<PirQuery> queries(num_buckets);
+    for (uint32_t b = 0; b < num_buckets; b++) {
+        uint64_t fv_index = 0;
+        if (occupant[b] >= 0) {
+            uint64_t position = layout_.position(elements[occupant[b]], b);
+            placement_[occupant[b]] = make_pair(b, position);
+            fv_index = client_.get_fv_index(position, batch_params_.ele_size);
+        }
+        queries[b] = client_.generate_query(fv_index);
+    }
+    return queries;
+}
+
+vector<vector<uint8_t>> PIRBatchClient::decode_reply(const vector<PirReply> &replies) {
+    if (replies.size() != batch_params_.num_buckets) {
+        throw invalid_argument("batch reply must have one reply per bucket");
+    }
+
+    uint64_t ele_size = batch_params_.ele_size;
+    uint32_t N = params_.poly_modulus_degree();
+    uint32_t logtp = floor(log2(params_.plain_modulus().value()));
+    vector<uint8_t> bytes(N * logtp / 8);
+
+    vector<vector<uint8_t>> result;
+    result.reserve(placement_.size());
+    for (const auto &placed : placement_) {
+        uint64_t position = placed.second;
+        uint64_t fv_index = client_.get_fv_index(position, ele_size);
+        uint64_t offset = client_.get_fv_offset(position, ele_size);
+
+        Plaintext plain = client_.decode_reply(replies[placed.first], fv_index);
+        fill(bytes.begin(), bytes.end(), 0);
+        coeffs_to_bytes(logtp, plain, bytes.data(), bytes.size());
+        result.emplace_back(bytes.begin() + offset * ele_size,
+                            bytes.begin() + (offset + 1) * ele_size);
+    }
+    return result;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_server.hpp"
+#include "thread_pool.hpp"
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Batch retrieval of up to max_batch elements in one round. Every element is
+// stored in num_hashes of num_buckets buckets, chosen by public hash
+// functions. The client places each element it wants in one of its buckets
+// with cuckoo hashing, at most one per bucket, and sends one query to every
+// bucket (a dummy one where it wants nothing), so the server learns nothing
+// about which buckets matter.
+//
+// The server's work is that of a single query over num_hashes (3) copies of
+// the database, not one pass over it. This is deliberate: with three choices
+// per element, 1.5 max_batch buckets place a batch without a stash, where two
+// choices would need over 2 max_batch buckets and a stash, each bucket a
+// query the client sends and decodes. Against max_batch separate queries it
+// is still a saving once max_batch exceeds three.
+//
+// All buckets are padded to the size of the largest, so they share one
+// EncryptionParameters and PirParams, and one client key serves them all.
+struct BatchParams {
+    std::uint64_t ele_num;      // elements in the whole database
+    std::uint64_t ele_size;
+    std::uint32_t max_batch;    // most elements retrieved at once
+    std::uint32_t num_buckets;
+    std::uint32_t num_hashes;   // buckets holding each element
+    std::uint64_t seed;         // of the hash functions, public
+    std::uint64_t bucket_size;  // elements per bucket
+};
+
+// Buckets for retrieving up to max_batch elements at once, and the parameters
+// of one bucket (as gen_params, for bucket_size elements). With 1.5 max_batch
+// buckets and 3 hash functions, placing max_batch elements fails with
+// negligible probability.
+void gen_batch_params(std::uint64_t ele_num, std::uint64_t ele_size, std::uint32_t max_batch,
+                      std::uint32_t N, std::uint32_t logt, std::uint32_t d,
+                      seal::EncryptionParameters &params, PirParams &pir_params,
+                      BatchParams &batch_params, bool mod_switch = false);
+
+// Which elements each bucket holds, in increasing order. The client and the
+// server both derive it from the public BatchParams.
+class BatchLayout {
+  public:
+    explicit BatchLayout(const BatchParams &batch_params);
+
+    // The num_hashes distinct buckets of an element, written to buckets
+    void buckets(std::uint64_t element, std::uint32_t *buckets) const;
+
+    // Index of an element within one of its buckets
+    std::uint64_t position(std::uint64_t element, std::uint32_t bucket) const;
+
+    const std::vector<std::uint64_t> &elements(std::uint32_t bucket) const {
+        return elements_[bucket];
+    }
+
+  private:
+    BatchParams batch_params_;
+    std::vector<std::vector<std::uint64_t>> elements_;
+};
+
+class PIRBatchServer {
+  public:
+    PIRBatchServer(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                   const BatchParams &batch_params);
+
+    // bytes holds the ele_num elements of ele_size bytes; each is encoded into
+    // every bucket that holds it
+    void set_database(const std::unique_ptr<const std::uint8_t[]> &bytes);
+
+    // The buckets share one key store, so a client's keys are stored once
+    void set_galois_key(std::uint32_t client_id, seal::GaloisKeys galkey);
+    void set_galois_key(std::uint32_t client_id, std::string_view message);
+
+    // Threads shared by the buckets; each bucket is answered on one of them
+    void set_num_threads(std::uint32_t num_threads);
+
+    // Answers the queries of all buckets; queries[b] is the query for bucket b
+    std::vector<PirReply> generate_reply(const std::vector<PirQuery> &queries,
+                                         std::uint32_t client_id);
+
+  private:
+    BatchParams batch_params_;
+    BatchLayout layout_;
+    std::vector<std::unique_ptr<PIRServer>> buckets_;
+    std::unique_ptr<ThreadPool> workers_;
+};
+
+class PIRBatchClient {
+  public:
+    PIRBatchClient(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                   const BatchParams &batch_params);
+
+    seal::GaloisKeys generate_galois_keys();
+    std::string generate_serialized_galois_keys();
+
+    // One query per bucket for up to max_batch elements. Throws
+    // runtime_error in the unlikely case that they cannot all be placed.
+    std::vector<PirQuery> generate_query(const std::vector<std::uint64_t> &elements);
+
+    // The elements of the last generate_query call, in the same order,
+    // ele_size bytes each. Replies of dummy queries are not decrypted.
+    std::vector<std::vector<std::uint8_t>> decode_reply(const std::vector<PirReply> &replies);
+
+  private:
+    seal::EncryptionParameters params_;
+    BatchParams batch_params_;
+    BatchLayout layout_;
+    PIRClient client_;
+    std::mt19937_64 rng_; // for the cuckoo evictions
+
+    // bucket and position in it of each element of the last query
+    std::vector<std::pair<std::uint32_t, std::uint64_t>> placement_;
+};
@@ -1,4 +1,6 @@
 #include "pir_client.hpp"
+#include "pir_kernels.hpp"
+#include <climits>
 
 using namespace std;
 using namespace seal;
@@ -6,19 +8,26 @@ using namespace seal::util;
 
 PIRClient::PIRClient(const EncryptionParameters &params,
                      const PirParams &pir_parms) :
-    params_(params){
+    params_(params),
+    symmetric_queries_(false) {
 
     newcontext_ = SEALContext::Create(params_);
 
     pir_params_ = pir_parms;
 
     keygen_ = make_unique<KeyGenerator>(newcontext_);
-    encryptor_ = make_unique<Encryptor>(newcontext_, keygen_->public_key());
-
     SecretKey secret_key = keygen_->secret_key();
 
+    // The secret key also allows seeded symmetric encryption for the wire format
+    encryptor_ = make_unique<Encryptor>(newcontext_, keygen_->public_key(), secret_key);
+
     decryptor_ = make_unique<Decryptor>(newcontext_, secret_key);
     evaluator_ = make_unique<Evaluator>(newcontext_);
+    workers_ = make_unique<ThreadPool>(1);
+}
+
+void PIRClient::set_num_threads(uint32_t num_threads) {
+    workers_ = make_unique<ThreadPool>(num_threads);
 }
 
 
@@ -29,30 +38,21 @@ PirQuery PIRClient::generate_query(uint64_t desiredIndex) {
     compute_inverse_scales(); 
 
     vector<vector<Ciphertext> > result(pir_params_.d);
-    int N = params_.poly_modulus_degree(); 
 
     Plaintext pt(params_.poly_modulus_degree());
     for (uint32_t i = 0; i < indices_.size(); i++) {
-        uint32_t num_ptxts = ceil( (pir_params_.nvec[i] + 0.0) / N);
+        uint32_t num_ptxts = query_ciphertexts(i);
         // initialize result. 
-        cout << "Client: index " << i + 1  <<  "/ " <<  indices_.size() << " = " << indices_[i] << endl; 
-        cout << "Client: number of ctxts needed for query = " << num_ptxts << endl;
+        PIR_LOG(LogLevel::debug, "Client: index " << i + 1 << "/ " << indices_.size() << " = " << indices_[i]);
+        PIR_LOG(LogLevel::debug, "Client: number of ctxts needed for query = " << num_ptxts);
         for (uint32_t j =0; j < num_ptxts; j++){
-            pt.set_zero();
-            if (indices_[i] > N*(j+1) || indices_[i] < N*j){
-#ifdef DEBUG
-                cout << "Client: coming here: so just encrypt zero." << endl; 
-#endif 
-                // just encrypt zero
-            } else{
-#ifdef DEBUG
-                cout << "Client: encrypting a real thing " << endl; 
-#endif 
-                uint64_t real_index = indices_[i] - N*j; 
-                pt[real_index] = 1;
-            }
+            query_plaintext(i, j, pt);
             Ciphertext dest;
-            encryptor_->encrypt(pt, dest);
+            if (symmetric_queries_) {
+                encryptor_->encrypt_symmetric(pt, dest);
+            } else {
+                encryptor_->encrypt(pt, dest);
+            }
             dest.parms_id() = newcontext_->first_parms_id();
             result[i].push_back(dest);
         }   
@@ -61,6 +61,50 @@ PirQuery PIRClient::generate_query(uint64_t desiredIndex) {
     return result;
 }
 
+string PIRClient::generate_serialized_query(uint64_t desiredIndex) {
+    string output;
+    generate_serialized_query(desiredIndex, output);
+    return output;
+}
+
+void PIRClient::generate_serialized_query(uint64_t desiredIndex, string &output) {
+
+    indices_ = compute_indices(desiredIndex, pir_params_.nvec);
+
+    compute_inverse_scales();
+
+    write_wire_header(output, WireKind::query);
+    write_wire_u32(output, indices_.size());
+
+    Plaintext pt(params_.poly_modulus_degree());
+    for (uint32_t i = 0; i < indices_.size(); i++) {
+        uint32_t num_ptxts = query_ciphertexts(i);
+        write_wire_u32(output, num_ptxts);
+        for (uint32_t j = 0; j < num_ptxts; j++) {
+            query_plaintext(i, j, pt);
+            // saved with a seed in place of the random polynomial
+            write_wire_object(output, encryptor_->encrypt_symmetric(pt));
+        }
+    }
+}
+
+uint32_t PIRClient::query_ciphertexts(uint32_t dimension) const {
+    return ceil((pir_params_.nvec[dimension] + 0.0) / params_.poly_modulus_degree());
+}
+
+void PIRClient::query_plaintext(uint32_t dimension, uint32_t j, Plaintext &pt) const {
+    uint64_t N = params_.poly_modulus_degree();
+    pt.set_zero();
+    if (indices_[dimension] >= N*(j+1) || indices_[dimension] < N*j){
+        PIR_LOG(LogLevel::debug, "Client: coming here: so just encrypt zero.");
+        // just encrypt zero
+    } else{
+        PIR_LOG(LogLevel::debug, "Client: encrypting a real thing ");
+        uint64_t real_index = indices_[dimension] - N*j; 
+        pt[real_index] = 1;
+    }
+}
+
 uint64_t PIRClient::get_fv_index(uint64_t element_idx, uint64_t ele_size) {
     auto N = params_.poly_modulus_degree();
     auto logt = floor(log2(params_.plain_modulus().value()));
@@ -77,55 +121,80 @@ uint64_t PIRClient::get_fv_offset(uint64_t element_idx, uint64_t ele_size) {
     return element_idx % ele_per_ptxt;
 }
 
-Plaintext PIRClient::decode_reply(PirReply reply) {
-    uint32_t exp_ratio = pir_params_.expansion_ratio;
-    uint32_t recursion_level = pir_params_.d;
+Plaintext PIRClient::decode_reply(const PirReply &reply, uint64_t desiredIndex) {
+    indices_ = compute_indices(desiredIndex, pir_params_.nvec);
+    compute_inverse_scales();
+    return decode_layers(reply, nullptr);
+}
 
-    vector<Ciphertext> temp = reply;
+Plaintext PIRClient::decode_reply(const PirReply &reply, uint64_t desiredIndex,
+                                  int &noise_budget) {
+    indices_ = compute_indices(desiredIndex, pir_params_.nvec);
+    compute_inverse_scales();
+    return decode_layers(reply, &noise_budget);
+}
 
+Plaintext PIRClient::decode_reply(const PirReply &reply) {
+    return decode_layers(reply, nullptr);
+}
+
+Plaintext PIRClient::decode_layers(const PirReply &reply, int *noise_budget) {
+    uint32_t exp_ratio = pir_params_.expansion_ratio;
+    uint32_t recursion_level = pir_params_.d;
     uint64_t t = params_.plain_modulus().value();
 
+    // Each layer reads the ciphertexts of the previous one in place and
+    // composes the next layer's into a second buffer; the buffers swap roles
+    const vector<Ciphertext> *temp = &reply;
+    vector<Ciphertext> current;
+    vector<Ciphertext> next;
+    vector<Plaintext> plains;
+    vector<int> budgets;
+    if (noise_budget) {
+        *noise_budget = INT_MAX;
+    }
+
     for (uint32_t i = 0; i < recursion_level; i++) {
-        cout << "Client: " << i + 1 << "/ " << recursion_level << "-th decryption layer started." << endl; 
-        vector<Ciphertext> newtemp;
-        vector<Plaintext> tempplain;
-
-        for (uint32_t j = 0; j < temp.size(); j++) {
-            Plaintext ptxt;
-            decryptor_->decrypt(temp[j], ptxt);
-#ifdef DEBUG
-            cout << "Client: reply noise budget = " << decryptor_->invariant_noise_budget(temp[j]) << endl; 
-#endif
-            // multiply by inverse_scale for every coefficient of ptxt
-            for(int h = 0; h < ptxt.coeff_count(); h++){
-                ptxt[h] *= inverse_scales_[recursion_level -  1 - i]; 
-                ptxt[h] %= t; 
-            }
-            //cout << "decoded (and scaled) plaintext = " << ptxt.to_string() << endl;
-            tempplain.push_back(ptxt);
-
-#ifdef DEBUG
-            cout << "recursion level : " << i << " noise budget :  ";
-            cout << decryptor_->invariant_noise_budget(temp[j]) << endl;
-#endif
-
-            if ((j + 1) % exp_ratio == 0 && j > 0) {
-                // Combine into one ciphertext.
-                Ciphertext combined = compose_to_ciphertext(tempplain);
-                newtemp.push_back(combined);
-                tempplain.clear();
-                // cout << "Client: const term of ciphertext = " << combined[0] << endl; 
+        PIR_LOG(LogLevel::debug, "Client: " << i + 1 << "/ " << recursion_level << "-th decryption layer started.");
+        uint64_t count = temp->size();
+        uint64_t inverse_scale = inverse_scales_[recursion_level - 1 - i];
+
+        // Each plaintext is scaled right after its decryption, while in cache
+        plains.resize(count);
+        budgets.resize(noise_budget ? count : 0);
+        workers_->parallel_for(count, [&](uint64_t begin, uint64_t end, uint32_t) {
+            for (uint64_t j = begin; j < end; j++) {
+                if (noise_budget) {
+                    budgets[j] = decryptor_->invariant_noise_budget((*temp)[j]);
+                }
+                decryptor_->decrypt((*temp)[j], plains[j]);
+                // decrypt drops high zero coefficients, compose reads all N
+                if (i < recursion_level - 1) {
+                    plains[j].resize(params_.poly_modulus_degree());
+                }
+                multiply_scalar_mod(plains[j].data(), plains[j].coeff_count(), inverse_scale, t);
             }
+        });
+        PIR_LOG(LogLevel::debug, "Client: reply noise budget = "
+                << decryptor_->invariant_noise_budget((*temp)[0]));
+        for (int budget : budgets) {
+            *noise_budget = min(*noise_budget, budget);
         }
-        cout << "Client: done." << endl; 
-        cout << endl; 
+
         if (i == recursion_level - 1) {
-            assert(temp.size() == 1);
-            return tempplain[0];
-        } else {
-            tempplain.clear();
-            temp = newtemp;
+            assert(count == 1);
+            return move(plains[0]);
         }
+
+        // Combine each group of exp_ratio plaintexts into one ciphertext
+        next.resize(count / exp_ratio);
+        workers_->parallel_for(next.size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+            for (uint64_t k = begin; k < end; k++) {
+                compose_to_ciphertext(plains.data() + k * exp_ratio, next[k]);
+            }
+        });
+        swap(current, next);
+        temp = &current;
     }
 
     // This should never be called
@@ -135,33 +204,46 @@ Plaintext PIRClient::decode_reply(PirReply reply) {
 }
 
 GaloisKeys PIRClient::generate_galois_keys() {
-    // Generate the Galois keys needed for coeff_select.
+    // TODO check that it's ok to drop this param?
+    // return keygen_->galois_keys(pir_params_.dbc, galois_elts);
+    return keygen_->galois_keys_local(galois_elements());
+}
+
+vector<uint32_t> PIRClient::galois_elements() const {
+    // The Galois elements needed for coeff_select.
     vector<uint32_t> galois_elts;
     int N = params_.poly_modulus_degree();
     int logN = get_power_of_two(N);
 
-    //cout << "printing galois elements...";
     for (int i = 0; i < logN; i++) {
         galois_elts.push_back((N + exponentiate_uint64(2, i)) / exponentiate_uint64(2, i));
-//#ifdef DEBUG
-        // cout << galois_elts.back() << ", ";
-//#endif
     }
+    return galois_elts;
+}
 
-    // TODO check that it's ok to drop this param?
-    // return keygen_->galois_keys(pir_params_.dbc, galois_elts);
-    return keygen_->galois_keys_local(galois_elts);
+string PIRClient::generate_serialized_galois_keys() {
+    string output;
+    write_wire_header(output, WireKind::galois_keys);
+    // saved with seeds in place of the random polynomials
+    write_wire_object(output, keygen_->galois_keys(galois_elements()));
+    return output;
 }
 
-Ciphertext PIRClient::compose_to_ciphertext(vector<Plaintext> plains) {
+void PIRClient::compose_to_ciphertext(const Plaintext *plains, Ciphertext &result) const {
     size_t encrypted_count = 2;
     auto coeff_count = params_.poly_modulus_degree();
-    auto coeff_mod_count = params_.coeff_modulus().size();
     uint64_t plainMod = params_.plain_modulus().value();
     int logt = floor(log2(plainMod)); 
 
-    Ciphertext result(newcontext_);
-    result.resize(encrypted_count);
+    // Reply ciphertexts are at the query's level, or at the last one when
+    // the server switches them down
+    auto parms_id = pir_params_.mod_switch ? newcontext_->last_parms_id()
+                                           : newcontext_->first_parms_id();
+    const auto &coeff_modulus = newcontext_->get_context_data(parms_id)->parms().coeff_modulus();
+    auto coeff_mod_count = coeff_modulus.size();
+
+    result.resize(newcontext_, parms_id, encrypted_count);
+    const Plaintext *plain = plains;
 
     // A triple for loop. Going over polys, moduli, and decomposed index.
     for (int i = 0; i < encrypted_count; i++) {
@@ -172,16 +254,13 @@ Ciphertext PIRClient::compose_to_ciphertext(vector<Plaintext> plains) {
             // create a polynomial to store the current decomposition value
             // which will be copied into the array to populate it at the current
             // index.
-            double logqj = log2(params_.coeff_modulus()[j].value());
+            double logqj = log2(coeff_modulus[j].value());
             int expansion_ratio = ceil(logqj / logt);
             uint64_t cur = 1;
-            // cout << "Client: expansion_ratio = " << expansion_ratio << endl; 
 
             for (int k = 0; k < expansion_ratio; k++) {
-                // Compose here
-                const uint64_t *plain_coeff =
-                    plains[k + j * (expansion_ratio) + i * (coeff_mod_count * expansion_ratio)]
-                        .data();
+                // Compose here, in the order decompose_to_plaintexts_ptr wrote them
+                const uint64_t *plain_coeff = (plain++)->data();
 
                 for (int m = 0; m < coeff_count; m++) {
                     if (k == 0) {
@@ -203,9 +282,6 @@ Ciphertext PIRClient::compose_to_ciphertext(vector<Plaintext> plains) {
             */
         }
     }
-
-    result.parms_id() = newcontext_->first_parms_id();
-    return result;
 }
 
 
@@ -213,38 +289,24 @@ void PIRClient::compute_inverse_scales(){
     if (indices_.size() != pir_params_.nvec.size()){
         throw invalid_argument("size mismatch"); 
     }
-    int logt = floor(log2(params_.plain_modulus().value())); 
-
     uint64_t N = params_.poly_modulus_degree(); 
-    uint64_t t = params_.plain_modulus().value();
-    int logN = log2(N);
-    int logm = logN;
+    const auto &t = params_.plain_modulus();
 
     inverse_scales_.clear(); 
 
     for(int i = 0; i < pir_params_.nvec.size(); i++){
-        uint64_t index_modN = indices_[i] % N; 
-        uint64_t numCtxt = ceil ( (pir_params_.nvec[i] + 0.0) / N);  // number of query ciphertexts. 
-        uint64_t batchId = indices_[i] / N;  
-        if (batchId == numCtxt - 1) {
-            cout << "Client: adjusting the logm value..." << endl; 
-            logm = ceil(log2((pir_params_.nvec[i] % N)));
-        }
-
-        uint64_t inverse_scale; 
- 
-
-        int quo = logm / logt; 
-        int mod = logm % logt; 
-        inverse_scale = pow(2, logt - mod); 
-        if ((quo +1) %2 != 0){
-            inverse_scale =  params_.plain_modulus().value() - pow(2, logt - mod); 
+        // The query ctxt holding the index expands into N entries, or the
+        // rest of the dimension for the last one
+        uint64_t batchId = indices_[i] / N;
+        uint64_t m = min(N, pir_params_.nvec[i] - batchId * N);
+        uint32_t depth = expansion_depth(m, indices_[i] % N);
+
+        // The expanded entry is scaled by 2^depth, which is invertible as t is odd
+        uint64_t inverse_scale;
+        if (!try_invert_uint_mod(exponentiate_uint_mod(2, depth, t), t, inverse_scale)) {
+            throw logic_error("expansion scale is not invertible mod t");
         }
         inverse_scales_.push_back(inverse_scale); 
-        if ( (inverse_scale << logm)  % t != 1){
-            throw logic_error("something wrong"); 
-        }
-        cout << "Client: logm, inverse scale, t = " << logm << ", " << inverse_scale << ", " << t << endl; 
+        PIR_LOG(LogLevel::debug, "Client: depth, inverse scale, t = " << depth << ", " << inverse_scale << ", " << t.value());
     }
 }
-
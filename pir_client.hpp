@@ -1,7 +1,9 @@
 #pragma once
 
 #include "pir.hpp"
+#include "thread_pool.hpp"
 #include <memory>
+#include <string>
 #include <vector>
 
 using namespace std; 
@@ -12,10 +14,39 @@ class PIRClient {
                const PirParams &pirparms);
 
     PirQuery generate_query(std::uint64_t desiredIndex);
-    seal::Plaintext decode_reply(PirReply reply);
+
+    // Encrypts the ciphertexts of generate_query with the secret key instead
+    // of the public key, which is faster and adds less noise. Off by default.
+    // Serialized queries are always encrypted this way, so they can be seeded.
+    void set_symmetric_queries(bool symmetric) { symmetric_queries_ = symmetric; }
+
+    // The same query in the wire format (see pir.hpp), encrypted with the
+    // secret key so that each ciphertext is sent as a seed and one polynomial
+    std::string generate_serialized_query(std::uint64_t desiredIndex);
+
+    // Same, appending to a caller's buffer, which can be reused across queries
+    void generate_serialized_query(std::uint64_t desiredIndex, std::string &output);
+
+    seal::Plaintext decode_reply(const PirReply &reply);
+
+    // Decodes the reply to a query for desiredIndex, which need not be the
+    // last query generated (the decoding depends on the index)
+    seal::Plaintext decode_reply(const PirReply &reply, std::uint64_t desiredIndex);
+
+    // Same, also setting noise_budget to the smallest invariant noise budget
+    // (in bits) of the ciphertexts decrypted on the way; 0 means the result
+    // is wrong
+    seal::Plaintext decode_reply(const PirReply &reply, std::uint64_t desiredIndex,
+                                 int &noise_budget);
+
+    // Number of threads decode_reply decrypts and composes with (1 by default)
+    void set_num_threads(std::uint32_t num_threads);
 
     seal::GaloisKeys generate_galois_keys();
 
+    // Seeded Galois keys in the wire format, about half the size of the above
+    std::string generate_serialized_galois_keys();
+
     // Index and offset of an element in an FV plaintext
     uint64_t get_fv_index(uint64_t element_idx, uint64_t ele_size);
     uint64_t get_fv_offset(uint64_t element_idx, uint64_t ele_size);
@@ -31,11 +62,26 @@ class PIRClient {
     std::unique_ptr<seal::Evaluator> evaluator_;
     std::unique_ptr<seal::KeyGenerator> keygen_;
     std::shared_ptr<seal::SEALContext> newcontext_;
+    std::unique_ptr<ThreadPool> workers_;
+
+    bool symmetric_queries_;
 
     vector<uint64_t> indices_; // the indices for retrieval. 
     vector<uint64_t> inverse_scales_; 
 
-    seal::Ciphertext compose_to_ciphertext(std::vector<seal::Plaintext> plains);
+    // Decodes reply; with noise_budget, also measures the budgets
+    seal::Plaintext decode_layers(const PirReply &reply, int *noise_budget);
+
+    // Composes the expansion_ratio plaintexts starting at plains into result
+    void compose_to_ciphertext(const seal::Plaintext *plains, seal::Ciphertext &result) const;
+
+    std::vector<std::uint32_t> galois_elements() const;
+
+    // Number of ciphertexts for a dimension of the query, and the plaintext
+    // of the j-th, which selects indices_[dimension] if it falls in its range
+    std::uint32_t query_ciphertexts(std::uint32_t dimension) const;
+    void query_plaintext(std::uint32_t dimension, std::uint32_t j, seal::Plaintext &pt) const;
 
     friend class PIRServer;
+    friend class PIRBenchmark;
 };
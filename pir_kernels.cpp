@@ -0,0 +1,242 @@
+#include "pir_kernels.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SEALPIR_IFMA_KERNEL
+#endif
+
+using namespace std;
+using namespace seal;
+
+namespace {
+
+typedef unsigned __int128 uint128_t;
+
+// Coefficients processed per pass for a single query. The accumulators for a
+// block stay in L1 while the terms stream through, and each plaintext block is
+// loaded once for all ciphertext polynomials of the batch. Larger batches use
+// proportionally smaller blocks so the accumulators still fit.
+constexpr size_t block_size = 256;
+
+size_t block_for_batch(size_t batch) {
+    return min(block_size, max<size_t>(8, (block_size / batch) & ~size_t(7)));
+}
+
+// Accumulator space for the calling thread, reused across calls.
+template <typename T>
+T *scratch(vector<T> &buffer, size_t size) {
+    if (buffer.size() < size) {
+        buffer.resize(size);
+    }
+    return buffer.data();
+}
+
+// Number of products of two values below q that can be added to an already
+// reduced accumulator before it could overflow 128 bits.
+uint64_t lazy_terms(const Modulus &q) {
+    int slack = 128 - 2 * q.bit_count();
+    return (uint64_t(1) << min(slack, 63)) - 1;
+}
+
+// Exact x mod q for any 128-bit x. Barrett reduction with the full product of
+// x and floor(2^128 / q), so the quotient is off by at most one.
+inline uint64_t reduce_128(uint128_t x, const Modulus &q) {
+    const uint64_t *ratio = q.const_ratio().data();
+    uint64_t x0 = static_cast<uint64_t>(x);
+    uint64_t x1 = static_cast<uint64_t>(x >> 64);
+
+    uint128_t low = (static_cast<uint128_t>(x0) * ratio[0]) >> 64;
+    uint128_t mid1 = static_cast<uint128_t>(x1) * ratio[0];
+    uint128_t mid2 = static_cast<uint128_t>(x0) * ratio[1];
+    uint128_t mid = low + static_cast<uint64_t>(mid1) + static_cast<uint64_t>(mid2);
+    uint64_t quotient = x1 * ratio[1] + static_cast<uint64_t>(mid1 >> 64) +
+                        static_cast<uint64_t>(mid2 >> 64) + static_cast<uint64_t>(mid >> 64);
+
+    uint64_t r = x0 - quotient * q.value();
+    return (r >= q.value()) ? r - q.value() : r;
+}
+
+// Portable kernel for one modulus and one block of coefficients. Accumulator
+// acc[(b * encrypted_count + i) * len + c] holds coefficient c of polynomial i
+// of query b.
+void dot_product_block(const Ciphertext *const *encrypted, size_t batch,
+                       const uint64_t *const *plain, size_t count, size_t offset, size_t len,
+                       const Modulus &q, Ciphertext *const *destination, bool accumulate) {
+    static thread_local vector<uint128_t> acc_buffer;
+    size_t encrypted_count = destination[0]->size();
+    size_t lanes = batch * encrypted_count * len;
+    uint128_t *acc = scratch(acc_buffer, lanes);
+    fill(acc, acc + lanes, 0);
+    if (accumulate) {
+        for (size_t b = 0; b < batch; b++) {
+            for (size_t i = 0; i < encrypted_count; i++) {
+                copy_n(destination[b]->data(i) + offset, len, acc + (b * encrypted_count + i) * len);
+            }
+        }
+    }
+
+    uint64_t lazy = lazy_terms(q);
+    uint64_t pending = 0;
+
+    for (size_t j = 0; j < count; j++) {
+        if (pending == lazy) {
+            for (size_t c = 0; c < lanes; c++) {
+                acc[c] = reduce_128(acc[c], q);
+            }
+            pending = 0;
+        }
+
+        const uint64_t *p = plain[j] + offset;
+        for (size_t b = 0; b < batch; b++) {
+            for (size_t i = 0; i < encrypted_count; i++) {
+                const uint64_t *e = encrypted[b][j].data(i) + offset;
+                uint128_t *a = acc + (b * encrypted_count + i) * len;
+                for (size_t c = 0; c < len; c++) {
+                    a[c] += static_cast<uint128_t>(e[c]) * p[c];
+                }
+            }
+        }
+        pending++;
+    }
+
+    for (size_t b = 0; b < batch; b++) {
+        for (size_t i = 0; i < encrypted_count; i++) {
+            uint64_t *d = destination[b]->data(i) + offset;
+            const uint128_t *a = acc + (b * encrypted_count + i) * len;
+            for (size_t c = 0; c < len; c++) {
+                d[c] = reduce_128(a[c], q);
+            }
+        }
+    }
+}
+
+#ifdef SEALPIR_IFMA_KERNEL
+// AVX-512 IFMA kernel, usable when every modulus is below 2^52. Each product is
+// split into its low and high 52 bits, which are summed in separate 64-bit lanes
+// for up to 4095 terms before being folded into the reduced value. AVX2 has no
+// 64-bit lane multiply, so machines without IFMA use the portable kernel.
+constexpr uint64_t ifma_fold_terms = 4095;
+
+__attribute__((target("avx512f,avx512ifma")))
+void dot_product_block_ifma(const Ciphertext *const *encrypted, size_t batch,
+                            const uint64_t *const *plain, size_t count, size_t offset,
+                            size_t len, const Modulus &q, Ciphertext *const *destination,
+                            bool accumulate) {
+    static thread_local vector<uint64_t> acc_buffer;
+    size_t encrypted_count = destination[0]->size();
+    size_t lanes = batch * encrypted_count * len;
+    uint64_t *lo = scratch(acc_buffer, 3 * lanes);
+    uint64_t *hi = lo + lanes;
+    uint64_t *folded = hi + lanes;
+    fill(lo, lo + 3 * lanes, 0);
+    if (accumulate) {
+        for (size_t b = 0; b < batch; b++) {
+            for (size_t i = 0; i < encrypted_count; i++) {
+                copy_n(destination[b]->data(i) + offset, len, folded + (b * encrypted_count + i) * len);
+            }
+        }
+    }
+
+    auto fold = [&](size_t c) {
+        uint128_t x = (static_cast<uint128_t>(hi[c]) << 52) + lo[c] + folded[c];
+        return reduce_128(x, q);
+    };
+
+    uint64_t pending = 0;
+    for (size_t j = 0; j < count; j++) {
+        if (pending == ifma_fold_terms) {
+            for (size_t c = 0; c < lanes; c++) {
+                folded[c] = fold(c);
+                lo[c] = 0;
+                hi[c] = 0;
+            }
+            pending = 0;
+        }
+
+        const uint64_t *p = plain[j] + offset;
+        for (size_t b = 0; b < batch; b++) {
+            for (size_t i = 0; i < encrypted_count; i++) {
+                const uint64_t *e = encrypted[b][j].data(i) + offset;
+                uint64_t *l = lo + (b * encrypted_count + i) * len;
+                uint64_t *h = hi + (b * encrypted_count + i) * len;
+                for (size_t c = 0; c < len; c += 8) {
+                    __m512i vp = _mm512_loadu_si512(p + c);
+                    __m512i ve = _mm512_loadu_si512(e + c);
+                    __m512i vl = _mm512_loadu_si512(l + c);
+                    __m512i vh = _mm512_loadu_si512(h + c);
+                    _mm512_storeu_si512(l + c, _mm512_madd52lo_epu64(vl, ve, vp));
+                    _mm512_storeu_si512(h + c, _mm512_madd52hi_epu64(vh, ve, vp));
+                }
+            }
+        }
+        pending++;
+    }
+
+    for (size_t b = 0; b < batch; b++) {
+        for (size_t i = 0; i < encrypted_count; i++) {
+            uint64_t *d = destination[b]->data(i) + offset;
+            size_t base = (b * encrypted_count + i) * len;
+            for (size_t c = 0; c < len; c++) {
+                d[c] = fold(base + c);
+            }
+        }
+    }
+}
+
+bool use_ifma(const vector<Modulus> &coeff_modulus, size_t coeff_count) {
+    static const bool cpu_has_ifma = __builtin_cpu_supports("avx512ifma");
+    if (!cpu_has_ifma || coeff_count % 8 != 0) {
+        return false;
+    }
+    return all_of(coeff_modulus.begin(), coeff_modulus.end(),
+                  [](const Modulus &q) { return q.bit_count() <= 52; });
+}
+#endif
+
+} // namespace
+
+void dot_product_ntt(const Ciphertext *const *encrypted, size_t batch,
+                     const uint64_t *const *plain, size_t count,
+                     const vector<Modulus> &coeff_modulus, size_t coeff_count,
+                     Ciphertext *const *destination, bool accumulate) {
+    if (batch == 0) {
+        return;
+    }
+    if (count == 0) {
+        throw invalid_argument("dot product needs at least one term");
+    }
+
+#ifdef SEALPIR_IFMA_KERNEL
+    bool ifma = use_ifma(coeff_modulus, coeff_count);
+#endif
+    size_t block = block_for_batch(batch);
+
+    for (size_t m = 0; m < coeff_modulus.size(); m++) {
+        for (size_t start = 0; start < coeff_count; start += block) {
+            size_t offset = m * coeff_count + start;
+            size_t len = min(block, coeff_count - start);
+#ifdef SEALPIR_IFMA_KERNEL
+            if (ifma) {
+                dot_product_block_ifma(encrypted, batch, plain, count, offset, len,
+                                       coeff_modulus[m], destination, accumulate);
+                continue;
+            }
+#endif
+            dot_product_block(encrypted, batch, plain, count, offset, len, coeff_modulus[m],
+                              destination, accumulate);
+        }
+    }
+}
+
+void multiply_scalar_mod(uint64_t *values, size_t count, uint64_t scalar, uint64_t modulus) {
+    scalar %= modulus;
+    uint64_t shoup = static_cast<uint64_t>((static_cast<uint128_t>(scalar) << 64) / modulus);
+    for (size_t i = 0; i < count; i++) {
+        // The quotient estimate is low by at most one, so r < 2 * modulus
+        uint64_t quotient = static_cast<uint64_t>((static_cast<uint128_t>(values[i]) * shoup) >> 64);
+        uint64_t r = values[i] * scalar - quotient * modulus;
+        values[i] = (r >= modulus) ? r - modulus : r;
+    }
+}
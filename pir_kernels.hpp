@@ -0,0 +1,41 @@
+#pragma once
+
+#include "seal/seal.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Inner products of NTT-form ciphertexts with NTT-form plaintexts, for a batch
+// of queries that share the plaintexts:
+//
+//   destination[b] = sum_{j < count} encrypted[b][j] * plain[j]    for b < batch
+//
+// All encrypted[b][j] must be at the level described by coeff_modulus, and each
+// plain[j] must point to an NTT-form plaintext at that level (coeff_modulus.size()
+// polynomials of coeff_count coefficients). Every destination[b] must already
+// have the size, level and NTT flag of the encrypted operands. Each block of a
+// plaintext is loaded once and multiplied with the whole batch while in cache.
+// Products are summed in 128-bit accumulators and each output coefficient is
+// reduced only once, instead of once per term as with Evaluator::multiply_plain
+// followed by add_inplace. The result is identical to that sequence of calls.
+// With accumulate set, the sum is added to the (reduced) values already in
+// destination, so a long dot product can be computed in blocks of terms.
+void dot_product_ntt(const seal::Ciphertext *const *encrypted, std::size_t batch,
+                     const std::uint64_t *const *plain, std::size_t count,
+                     const std::vector<seal::Modulus> &coeff_modulus, std::size_t coeff_count,
+                     seal::Ciphertext *const *destination, bool accumulate = false);
+
+// Single-query form of the above.
+inline void dot_product_ntt(const seal::Ciphertext *encrypted, const std::uint64_t *const *plain,
+                            std::size_t count, const std::vector<seal::Modulus> &coeff_modulus,
+                            std::size_t coeff_count, seal::Ciphertext &destination,
+                            bool accumulate = false) {
+    seal::Ciphertext *dest = &destination;
+    dot_product_ntt(&encrypted, 1, plain, count, coeff_modulus, coeff_count, &dest, accumulate);
+}
+
+// values[i] = values[i] * scalar mod modulus, for values below a modulus of at
+// most 63 bits. Shoup multiplication: floor(scalar * 2^64 / modulus) is
+// computed once, so each value takes two multiplications and no division.
+void multiply_scalar_mod(std::uint64_t *values, std::size_t count, std::uint64_t scalar,
+                         std::uint64_t modulus);
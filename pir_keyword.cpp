@@ -0,0 +1,209 @@
+#include "pir_keyword.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+using namespace seal;
+
+namespace {
+
+constexpr uint64_t default_seed = 0x6b657977307264ULL;
+
+// Standard deviations of the bucket load kept below the capacity
+constexpr double overflow_deviations = 5;
+
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+} // namespace
+
+void gen_keyword_params(uint64_t num_entries, uint64_t key_size, uint64_t value_size,
+                        uint32_t N, uint32_t logt, uint32_t d, EncryptionParameters &params,
+                        PirParams &pir_params, KeywordParams &keyword_params,
+                        bool mod_switch) {
+    if (num_entries == 0 || key_size == 0) {
+        throw invalid_argument("database and keys must be nonempty");
+    }
+
+    keyword_params.num_entries = num_entries;
+    keyword_params.key_size = key_size;
+    keyword_params.value_size = value_size;
+    keyword_params.seed = default_seed;
+
+    // As many entries as fit in a plaintext of logt - 1 bit coefficients
+    uint32_t logtp = logt - 1;
+    uint64_t entry_size = keyword_entry_size(keyword_params);
+    uint64_t capacity = N * logtp / 8 / entry_size;
+    while (capacity > 0 && coefficients_per_element(logtp, capacity * entry_size) > N) {
+        capacity--;
+    }
+    if (capacity == 0) {
+        throw invalid_argument("an entry does not fit in a plaintext");
+    }
+    keyword_params.bucket_capacity = capacity;
+
+    // Loads are roughly Poisson: the largest mean load lambda with
+    // lambda + k sqrt(lambda) <= capacity
+    double root = (sqrt(overflow_deviations * overflow_deviations + 4.0 * capacity)
+                   - overflow_deviations) / 2;
+    double load = max(root * root, 1.0);
+    keyword_params.num_buckets = max<uint64_t>(1, ceil(num_entries / load));
+
+    gen_params(keyword_params.num_buckets, capacity * entry_size, N, logt, d, params, pir_params,
+               mod_switch);
+
+    PIR_LOG(LogLevel::debug, "Keyword: " << keyword_params.num_buckets << " buckets of "
+            << capacity << " entries, expected load " << double(num_entries) /
+            keyword_params.num_buckets);
+}
+
+uint64_t keyword_bucket(const KeywordParams &keyword_params, const uint8_t *key) {
+    uint64_t state = splitmix64(keyword_params.seed);
+    for (uint64_t i = 0; i < keyword_params.key_size; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, min<uint64_t>(8, keyword_params.key_size - i));
+        state = splitmix64(state ^ word);
+    }
+    return state % keyword_params.num_buckets;
+}
+
+PIRKeywordServer::PIRKeywordServer(const EncryptionParameters &params,
+                                   const PirParams &pir_params,
+                                   const KeywordParams &keyword_params) :
+    keyword_params_(keyword_params),
+    server_(make_unique<PIRServer>(params, pir_params))
+{}
+
+void PIRKeywordServer::set_database(const uint8_t *keys, const uint8_t *values) {
+    uint64_t num_buckets = keyword_params_.num_buckets;
+    uint64_t capacity = keyword_params_.bucket_capacity;
+    uint64_t key_size = keyword_params_.key_size;
+    uint64_t value_size = keyword_params_.value_size;
+    uint64_t entry_size = keyword_entry_size(keyword_params_);
+
+    // Entries sorted by bucket: bucket b holds order[start[b]..start[b + 1])
+    vector<uint64_t> bucket(keyword_params_.num_entries);
+    vector<uint64_t> start(num_buckets + 1, 0);
+    for (uint64_t i = 0; i < keyword_params_.num_entries; i++) {
+        bucket[i] = keyword_bucket(keyword_params_, keys + i * key_size);
+        start[bucket[i] + 1]++;
+    }
+    for (uint64_t b = 0; b < num_buckets; b++) {
+        if (start[b + 1] > capacity) {
+            throw runtime_error("bucket overflow, more buckets are needed");
+        }
+        start[b + 1] += start[b];
+    }
+    vector<uint64_t> order(keyword_params_.num_entries);
+    vector<uint64_t> next(start.begin(), start.end() - 1);
+    for (uint64_t i = 0; i < keyword_params_.num_entries; i++) {
+        order[next[bucket[i]]++] = i;
+    }
+
+    // Buckets are laid out one at a time as the server reads them
+    uint64_t bucket_bytes = capacity * entry_size;
+    vector<uint8_t> current(bucket_bytes);
+    uint64_t b = 0;
+    uint64_t offset = bucket_bytes;
+    auto read_chunk = [&](uint8_t *buffer, uint64_t size) {
+        while (size > 0) {
+            if (offset == bucket_bytes) {
+                fill(current.begin(), current.end(), 0);
+                uint8_t *entry = current.data();
+                for (uint64_t j = start[b]; j < start[b + 1]; j++, entry += entry_size) {
+                    entry[0] = 1;
+                    memcpy(entry + 1, keys + order[j] * key_size, key_size);
+                    memcpy(entry + 1 + key_size, values + order[j] * value_size, value_size);
+                }
+                b++;
+                offset = 0;
+            }
+            uint64_t count = min(size, bucket_bytes - offset);
+            memcpy(buffer, current.data() + offset, count);
+            buffer += count;
+            offset += count;
+            size -= count;
+        }
+    };
+    server_->set_database(read_chunk, num_buckets, bucket_bytes);
+}
+
+void PIRKeywordServer::set_galois_key(uint32_t client_id, GaloisKeys galkey) {
+    server_->set_galois_key(client_id, move(galkey));
+}
+
+void PIRKeywordServer::set_galois_key(uint32_t client_id, string_view message) {
+    server_->set_galois_key(client_id, message);
+}
+
+void PIRKeywordServer::set_num_threads(uint32_t num_threads) {
+    server_->set_num_threads(num_threads);
+}
+
+PirQuery PIRKeywordServer::deserialize_query(string_view message) const {
+    return server_->deserialize_query(message);
+}
+
+PirReply PIRKeywordServer::generate_reply(const PirQuery &query, uint32_t client_id) {
+    return server_->generate_reply(query, client_id);
+}
+
+PIRKeywordClient::PIRKeywordClient(const EncryptionParameters &params,
+                                   const PirParams &pir_params,
+                                   const KeywordParams &keyword_params) :
+    params_(params),
+    keyword_params_(keyword_params),
+    client_(params, pir_params)
+{}
+
+GaloisKeys PIRKeywordClient::generate_galois_keys() {
+    return client_.generate_galois_keys();
+}
+
+string PIRKeywordClient::generate_serialized_galois_keys() {
+    return client_.generate_serialized_galois_keys();
+}
+
+PirQuery PIRKeywordClient::generate_query(const uint8_t *key) {
+    uint64_t bucket_bytes = keyword_params_.bucket_capacity * keyword_entry_size(keyword_params_);
+    uint64_t bucket = keyword_bucket(keyword_params_, key);
+    return client_.generate_query(client_.get_fv_index(bucket, bucket_bytes));
+}
+
+string PIRKeywordClient::generate_serialized_query(const uint8_t *key) {
+    uint64_t bucket_bytes = keyword_params_.bucket_capacity * keyword_entry_size(keyword_params_);
+    uint64_t bucket = keyword_bucket(keyword_params_, key);
+    return client_.generate_serialized_query(client_.get_fv_index(bucket, bucket_bytes));
+}
+
+bool PIRKeywordClient::decode_reply(const PirReply &reply, const uint8_t *key,
+                                    vector<uint8_t> &value) {
+    uint64_t key_size = keyword_params_.key_size;
+    uint64_t entry_size = keyword_entry_size(keyword_params_);
+    uint64_t bucket_bytes = keyword_params_.bucket_capacity * entry_size;
+    uint64_t bucket = keyword_bucket(keyword_params_, key);
+    uint64_t fv_index = client_.get_fv_index(bucket, bucket_bytes);
+    uint64_t offset = client_.get_fv_offset(bucket, bucket_bytes);
+
+    uint32_t N = params_.poly_modulus_degree();
+    uint32_t logtp = floor(log2(params_.plain_modulus().value()));
+    vector<uint8_t> bytes(N * logtp / 8, 0);
+    Plaintext plain = client_.decode_reply(reply, fv_index);
+    coeffs_to_bytes(logtp, plain, bytes.data(), bytes.size());
+
+    // Used entries come first, so the first unused one ends the search
+    const uint8_t *entry = bytes.data() + offset * bucket_bytes;
+    for (uint64_t j = 0; j < keyword_params_.bucket_capacity && entry[0] == 1;
+         j++, entry += entry_size) {
+        if (memcmp(entry + 1, key, key_size) == 0) {
+            value.assign(entry + 1 + key_size, entry + entry_size);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_server.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Keyword PIR over a key-value database. Keys are hashed into num_buckets
+// buckets of bucket_capacity entries each, and a bucket is stored as one
+// database element, sized so that it fills an FV plaintext. The client asks
+// for the bucket of its key with an ordinary query and looks for the key
+// among the entries it gets back, so the server sees neither the key nor
+// whether it was present.
+//
+// An entry is a byte that is 1 if the entry is used, then the key, then the
+// value. Unused entries are all zeros.
+struct KeywordParams {
+    std::uint64_t num_entries;
+    std::uint64_t key_size;
+    std::uint64_t value_size;
+    std::uint64_t num_buckets;
+    std::uint64_t bucket_capacity; // entries per bucket
+    std::uint64_t seed;            // of the hash function, public
+};
+
+// Bytes of one entry in a bucket
+inline std::uint64_t keyword_entry_size(const KeywordParams &keyword_params) {
+    return 1 + keyword_params.key_size + keyword_params.value_size;
+}
+
+// Buckets for num_entries keys and the parameters of the database of buckets
+// (as gen_params). There are enough buckets that the expected load sits five
+// standard deviations below the capacity, so an overflow is very unlikely.
+// The margin costs space: buckets of 149 entries (32-byte keys and values,
+// N = 4096, logt = 20) are filled to about 99, a load of about 0.66, so the
+// table takes about 1.5 times the plaintexts of the index path. Larger
+// buckets fill closer to their capacity.
+void gen_keyword_params(std::uint64_t num_entries, std::uint64_t key_size,
+                        std::uint64_t value_size, std::uint32_t N, std::uint32_t logt,
+                        std::uint32_t d, seal::EncryptionParameters &params,
+                        PirParams &pir_params, KeywordParams &keyword_params,
+                        bool mod_switch = false);
+
+// The bucket of a key of key_size bytes
+std::uint64_t keyword_bucket(const KeywordParams &keyword_params, const std::uint8_t *key);
+
+class PIRKeywordServer {
+  public:
+    PIRKeywordServer(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                     const KeywordParams &keyword_params);
+
+    // keys and values hold num_entries keys of key_size bytes and their values
+    // of value_size bytes, in the same order. Keys must be distinct. Throws
+    // runtime_error if a bucket overflows.
+    void set_database(const std::uint8_t *keys, const std::uint8_t *values);
+
+    void set_galois_key(std::uint32_t client_id, seal::GaloisKeys galkey);
+    void set_galois_key(std::uint32_t client_id, std::string_view message);
+    void set_num_threads(std::uint32_t num_threads);
+
+    PirQuery deserialize_query(std::string_view message) const;
+    PirReply generate_reply(const PirQuery &query, std::uint32_t client_id);
+
+  private:
+    KeywordParams keyword_params_;
+    std::unique_ptr<PIRServer> server_;
+};
+
+class PIRKeywordClient {
+  public:
+    PIRKeywordClient(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                     const KeywordParams &keyword_params);
+
+    seal::GaloisKeys generate_galois_keys();
+    std::string generate_serialized_galois_keys();
+
+    // A query for the bucket of key, plain or in the wire format
+    PirQuery generate_query(const std::uint8_t *key);
+    std::string generate_serialized_query(const std::uint8_t *key);
+
+    // Looks for key in the reply to a query for it. Returns whether the key
+    // is in the database, and if so writes its value to value.
+    bool decode_reply(const PirReply &reply, const std::uint8_t *key,
+                      std::vector<std::uint8_t> &value);
+
+  private:
+    seal::EncryptionParameters params_;
+    KeywordParams keyword_params_;
+    PIRClient client_;
+};
@@ -1,5 +1,14 @@
 #include "pir_server.hpp"
 #include "pir_client.hpp"
+#include "pir_kernels.hpp"
+#include "seal/util/ntt.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace seal;
@@ -8,14 +17,40 @@ using namespace seal::util;
 PIRServer::PIRServer(const EncryptionParameters &params, const PirParams &pir_params) :
     params_(params), 
     pir_params_(pir_params),
-    is_db_preprocessed_(false)
+    is_db_preprocessed_(false),
+    ele_num_(0),
+    ele_size_(0),
+    db_mapping_offset_(0),
+    compact_db_(false)
 {
-    context_ = SEALContext::Create(params, false);
+    // The full modulus switching chain, for replies switched to the last level
+    context_ = SEALContext::Create(params, true);
     evaluator_ = make_unique<Evaluator>(context_);
+    workers_ = make_unique<ThreadPool>(1);
+    galois_keys_ = make_shared<GaloisKeyStore>(context_);
+
+    auto n = params_.poly_modulus_degree();
+    for (uint32_t i = 0; (uint64_t(1) << i) < n; i++) {
+        galois_elts_.push_back((n + (uint64_t(1) << i)) >> i);
+    }
+
+    // Size one workspace up front, so the first query does not have to
+    WorkspaceLease lease{*this, acquire_workspace()};
+    prepare_workspace(*lease.ws, 1);
+}
+
+void PIRServer::set_num_threads(uint32_t num_threads) {
+    workers_ = make_unique<ThreadPool>(num_threads);
+}
+
+void PIRServer::set_reply_observer(function<void(const ReplyStats &)> observer) {
+    reply_observer_ = move(observer);
 }
 
 void PIRServer::preprocess_database() {
-    if (!is_db_preprocessed_) {
+    // Concurrent replies may all find the database not yet preprocessed
+    lock_guard<mutex> lock(preprocess_mutex_);
+    if (!is_db_preprocessed_ && db_) {
 
         for (uint32_t i = 0; i < db_->size(); i++) {
             evaluator_->transform_to_ntt_inplace(
@@ -33,12 +68,334 @@ void PIRServer::set_database(unique_ptr<vector<Plaintext>> &&db) {
     }
 
     db_ = move(db);
+    db_mapping_.reset();
+    db_packed_ = vector<uint64_t>();
     is_db_preprocessed_ = false;
+    ele_num_ = 0;
+    ele_size_ = 0;
+    if (compact_db_) {
+        pack_database();
+    }
+}
+
+namespace {
+
+// Bit-packed coefficients: coefficient i takes bits [i * bits, (i + 1) * bits)
+// of the words array. Every plaintext starts on a word boundary.
+void pack_coefficients(const uint64_t *coeffs, size_t count, int bits, uint64_t *packed,
+                       size_t words) {
+    fill_n(packed, words, 0);
+    for (size_t i = 0; i < count; i++) {
+        size_t bit = i * bits;
+        size_t shift = bit % 64;
+        packed[bit / 64] |= coeffs[i] << shift;
+        if (shift + bits > 64) {
+            packed[bit / 64 + 1] |= coeffs[i] >> (64 - shift);
+        }
+    }
+}
+
+void unpack_coefficients(const uint64_t *packed, size_t count, int bits, uint64_t *coeffs) {
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t bit = i * bits;
+        size_t shift = bit % 64;
+        uint64_t value = packed[bit / 64] >> shift;
+        if (shift + bits > 64) {
+            value |= packed[bit / 64 + 1] << (64 - shift);
+        }
+        coeffs[i] = value & mask;
+    }
+}
+
+// Bytes of NTT-form plaintexts each thread expands at a time in compact
+// storage; small enough to stay in L2 while it is multiplied.
+const uint64_t compact_block_bytes = 1 << 18;
+
+} // namespace
+
+void PIRServer::set_compact_storage(bool compact) {
+    if (compact == compact_db_) {
+        return;
+    }
+    compact_db_ = compact;
+    if (compact && db_) {
+        pack_database();
+    } else if (!compact && !db_packed_.empty()) {
+        unpack_database();
+    }
+}
+
+uint64_t PIRServer::packed_words() const {
+    uint64_t bits = params_.plain_modulus().bit_count();
+    return (params_.poly_modulus_degree() * bits + 63) / 64;
+}
+
+uint64_t PIRServer::compact_block_terms() const {
+    auto parms_id = context_->first_parms_id();
+    uint64_t plaintext_bytes = params_.poly_modulus_degree() * sizeof(uint64_t) *
+        context_->get_context_data(parms_id)->parms().coeff_modulus().size();
+    return max<uint64_t>(1, compact_block_bytes / plaintext_bytes);
+}
+
+// Moves db_ into compact storage. Plaintexts may be in either form; the
+// coefficients are below t, so the first RNS component of the NTT form
+// holds them exactly.
+void PIRServer::pack_database() {
+    uint64_t N = params_.poly_modulus_degree();
+    int bits = params_.plain_modulus().bit_count();
+    uint64_t words = packed_words();
+    auto context_data = context_->get_context_data(context_->first_parms_id());
+
+    vector<uint64_t> packed(db_->size() * words);
+    workers_->parallel_for(db_->size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        vector<uint64_t> coeffs(N);
+        for (uint64_t i = begin; i < end; i++) {
+            const Plaintext &plain = (*db_)[i];
+            if (plain.is_ntt_form()) {
+                copy_n(plain.data(), N, coeffs.data());
+                inverse_ntt_negacyclic_harvey(coeffs.data(), context_data->small_ntt_tables()[0]);
+            } else {
+                if (plain.coeff_count() > N) {
+                    throw invalid_argument("database plaintext has too many coefficients");
+                }
+                fill(coeffs.begin(), coeffs.end(), 0);
+                copy_n(plain.data(), plain.coeff_count(), coeffs.data());
+            }
+            pack_coefficients(coeffs.data(), N, bits, packed.data() + i * words, words);
+        }
+    });
+
+    db_packed_ = move(packed);
+    db_.reset();
+    is_db_preprocessed_ = true;
+}
+
+// Moves a database in compact storage back to NTT-form plaintexts
+void PIRServer::unpack_database() {
+    auto parms_id = context_->first_parms_id();
+    uint64_t plaintext_words = params_.poly_modulus_degree() *
+        context_->get_context_data(parms_id)->parms().coeff_modulus().size();
+    uint64_t words = packed_words();
+
+    auto db = make_unique<vector<Plaintext>>(db_packed_.size() / words);
+    workers_->parallel_for(db->size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t i = begin; i < end; i++) {
+            Plaintext &plain = (*db)[i];
+            plain.resize(plaintext_words);
+            unpack_to_ntt(db_packed_.data() + i * words, plain.data());
+            plain.parms_id() = parms_id;
+        }
+    });
+
+    db_ = move(db);
+    db_packed_ = vector<uint64_t>();
+    is_db_preprocessed_ = true;
+}
+
+// Same result as Evaluator::transform_to_ntt_inplace on the unpacked plaintext
+void PIRServer::unpack_to_ntt(const uint64_t *packed, uint64_t *destination) const {
+    uint64_t N = params_.poly_modulus_degree();
+    auto context_data = context_->get_context_data(context_->first_parms_id());
+    size_t coeff_mod_count = context_data->parms().coeff_modulus().size();
+
+    unpack_coefficients(packed, N, params_.plain_modulus().bit_count(), destination);
+    for (size_t m = 1; m < coeff_mod_count; m++) {
+        copy_n(destination, N, destination + m * N);
+    }
+    for (size_t m = 0; m < coeff_mod_count; m++) {
+        ntt_negacyclic_harvey(destination + m * N, context_data->small_ntt_tables()[m]);
+    }
+}
+
+namespace {
+
+// Layout of a file written by save_database. All integers use the host byte
+// order; the header is followed by the coefficient moduli of the database level
+// (coeff_mod_count words), then nvec (d words), then zero padding up to
+// data_offset, where the plaintexts start. Each plaintext is stored in NTT form
+// as coeff_mod_count * N words, in the same order as the in-memory database.
+struct DatabaseFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint64_t parms_id[4];
+    std::uint64_t poly_modulus_degree;
+    std::uint64_t coeff_mod_count;
+    std::uint64_t plain_modulus;
+    std::uint64_t d;
+    std::uint64_t plaintext_count;
+    std::uint64_t data_offset;
+};
+
+const char db_file_magic[8] = {'S', 'E', 'A', 'L', 'P', 'I', 'R', 'D'};
+const uint32_t db_file_version = 1;
+const uint64_t db_file_alignment = 4096;
+
+} // namespace
+
+void PIRServer::save_database(const string &path) {
+    if (!db_packed_.empty()) {
+        throw logic_error("a database in compact storage cannot be saved");
+    }
+    if (!db_) {
+        throw logic_error("no in-memory database to save");
+    }
+    preprocess_database();
+
+    auto parms_id = context_->first_parms_id();
+    const auto &coeff_modulus = context_->get_context_data(parms_id)->parms().coeff_modulus();
+    uint64_t N = params_.poly_modulus_degree();
+    uint64_t plaintext_words = N * coeff_modulus.size();
+
+    DatabaseFileHeader header = {};
+    copy(begin(db_file_magic), end(db_file_magic), header.magic);
+    header.version = db_file_version;
+    header.header_size = sizeof(DatabaseFileHeader);
+    copy(parms_id.begin(), parms_id.end(), header.parms_id);
+    header.poly_modulus_degree = N;
+    header.coeff_mod_count = coeff_modulus.size();
+    header.plain_modulus = params_.plain_modulus().value();
+    header.d = pir_params_.nvec.size();
+    header.plaintext_count = db_->size();
+
+    vector<uint64_t> trailer;
+    for (const auto &q : coeff_modulus) {
+        trailer.push_back(q.value());
+    }
+    trailer.insert(trailer.end(), pir_params_.nvec.begin(), pir_params_.nvec.end());
+
+    // Page-align the plaintexts so the mapping can be used directly
+    uint64_t used = sizeof(header) + trailer.size() * sizeof(uint64_t);
+    header.data_offset = (used + db_file_alignment - 1) / db_file_alignment * db_file_alignment;
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out) {
+        throw runtime_error("cannot open " + path + " for writing");
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(trailer.data()), trailer.size() * sizeof(uint64_t));
+    vector<char> padding(header.data_offset - used, 0);
+    out.write(padding.data(), padding.size());
+
+    for (const auto &plain : *db_) {
+        if (plain.coeff_count() != plaintext_words) {
+            throw logic_error("database plaintext has an unexpected size");
+        }
+        out.write(reinterpret_cast<const char *>(plain.data()), plaintext_words * sizeof(uint64_t));
+    }
+    out.close();
+    if (!out) {
+        throw runtime_error("failed to write " + path);
+    }
+}
+
+void PIRServer::load_database(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(DatabaseFileHeader)) {
+        close(fd);
+        throw runtime_error(path + " is not a database file");
+    }
+    uint64_t file_size = st.st_size;
+    void *addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw runtime_error("cannot map " + path);
+    }
+    shared_ptr<const uint8_t> mapping(static_cast<const uint8_t *>(addr),
+        [file_size](const uint8_t *p) { munmap(const_cast<uint8_t *>(p), file_size); });
+
+    // Check that the file holds this server's database before using it
+    DatabaseFileHeader header;
+    memcpy(&header, mapping.get(), sizeof(header));
+    if (!equal(begin(db_file_magic), end(db_file_magic), header.magic)) {
+        throw runtime_error(path + " is not a database file");
+    }
+    if (header.version != db_file_version || header.header_size != sizeof(DatabaseFileHeader)) {
+        throw runtime_error(path + " has an unsupported version");
+    }
+
+    auto parms_id = context_->first_parms_id();
+    const auto &coeff_modulus = context_->get_context_data(parms_id)->parms().coeff_modulus();
+    uint64_t N = params_.poly_modulus_degree();
+    uint64_t product = 1;
+    for (auto n : pir_params_.nvec) {
+        product *= n;
+    }
+
+    if (!equal(parms_id.begin(), parms_id.end(), header.parms_id) ||
+        header.poly_modulus_degree != N ||
+        header.coeff_mod_count != coeff_modulus.size() ||
+        header.plain_modulus != params_.plain_modulus().value() ||
+        header.d != pir_params_.nvec.size() ||
+        header.plaintext_count != product) {
+        throw invalid_argument(path + " was written for different parameters");
+    }
+
+    uint64_t trailer_words = header.coeff_mod_count + header.d;
+    uint64_t data_size = header.plaintext_count * N * header.coeff_mod_count * sizeof(uint64_t);
+    if (header.data_offset % sizeof(uint64_t) != 0 ||
+        header.data_offset < sizeof(header) + trailer_words * sizeof(uint64_t) ||
+        file_size < header.data_offset + data_size) {
+        throw runtime_error(path + " is truncated");
+    }
+
+    const uint64_t *trailer = reinterpret_cast<const uint64_t *>(mapping.get() + sizeof(header));
+    for (size_t i = 0; i < coeff_modulus.size(); i++) {
+        if (trailer[i] != coeff_modulus[i].value()) {
+            throw invalid_argument(path + " was written for different parameters");
+        }
+    }
+    if (!equal(pir_params_.nvec.begin(), pir_params_.nvec.end(), trailer + header.coeff_mod_count)) {
+        throw invalid_argument(path + " was written for different parameters");
+    }
+
+    db_.reset();
+    db_packed_ = vector<uint64_t>();
+    db_mapping_ = move(mapping);
+    db_mapping_offset_ = header.data_offset;
+    is_db_preprocessed_ = true;
 }
 
 void PIRServer::set_database(const std::unique_ptr<const std::uint8_t[]> &bytes, 
     uint64_t ele_num, uint64_t ele_size) {
 
+    uint64_t offset = 0;
+    encode_database([&](uint8_t *buffer, uint64_t size) {
+        memcpy(buffer, bytes.get() + offset, size);
+        offset += size;
+    }, ele_num, ele_size, false);
+}
+
+void PIRServer::set_database(const function<void(uint8_t *, uint64_t)> &read_chunk,
+    uint64_t ele_num, uint64_t ele_size) {
+
+    encode_database(read_chunk, ele_num, ele_size, true);
+}
+
+void PIRServer::set_database(int fd, uint64_t ele_num, uint64_t ele_size) {
+    encode_database([fd](uint8_t *buffer, uint64_t size) {
+        while (size > 0) {
+            ssize_t n = read(fd, buffer, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw runtime_error("database file ended before all elements were read");
+            }
+            buffer += n;
+            size -= n;
+        }
+    }, ele_num, ele_size, true);
+}
+
+void PIRServer::encode_database(const function<void(uint8_t *, uint64_t)> &read_chunk,
+    uint64_t ele_num, uint64_t ele_size, bool ntt) {
+
     uint32_t logt = floor(log2(params_.plain_modulus().value()));
     uint32_t N = params_.poly_modulus_degree();
 
@@ -53,9 +410,6 @@ void PIRServer::set_database(const std::unique_ptr<const std::uint8_t[]> &bytes,
     uint64_t matrix_plaintexts = prod;
     assert(total <= matrix_plaintexts);
 
-    auto result = make_unique<vector<Plaintext>>();
-    result->reserve(matrix_plaintexts);
-
     uint64_t ele_per_ptxt = elements_per_ptxt(logt, N, ele_size);
     uint64_t bytes_per_ptxt = ele_per_ptxt * ele_size;
 
@@ -64,323 +418,907 @@ void PIRServer::set_database(const std::unique_ptr<const std::uint8_t[]> &bytes,
     uint64_t coeff_per_ptxt = ele_per_ptxt * coefficients_per_element(logt, ele_size);
     assert(coeff_per_ptxt <= N);
 
-    cout << "Server: total number of FV plaintext = " << total << endl;
-    cout << "Server: elements packed into each plaintext " << ele_per_ptxt << endl; 
+    PIR_LOG(LogLevel::info, "Server: total number of FV plaintext = " << total);
+    PIR_LOG(LogLevel::info, "Server: elements packed into each plaintext " << ele_per_ptxt);
+
+    // Every plaintext is encoded straight into its final slot (or packed, in
+    // compact storage). Plaintexts past the end of the data are padding that
+    // makes the database a matrix.
+    unique_ptr<vector<Plaintext>> result;
+    vector<uint64_t> packed;
+    int bits = params_.plain_modulus().bit_count();
+    uint64_t words = packed_words();
+    if (compact_db_) {
+        packed.resize(matrix_plaintexts * words);
+    } else {
+        result = make_unique<vector<Plaintext>>(matrix_plaintexts);
+    }
+
+    // Records are read one group of plaintexts at a time (one per thread), and
+    // each group is encoded (and transformed to NTT) in parallel, so at most one
+    // group of raw records is held at any time.
+    uint64_t group = workers_->num_threads();
+    vector<uint8_t> chunk(group * bytes_per_ptxt);
+    vector<uint64_t> process_bytes(group);
+    uint64_t offset = 0;
+
+    for (uint64_t first = 0; first < matrix_plaintexts; first += group) {
+        uint64_t count = min(group, matrix_plaintexts - first);
+
+        for (uint64_t g = 0; g < count; g++) {
+            process_bytes[g] = (offset < db_size) ? min(bytes_per_ptxt, db_size - offset) : 0;
+            if (process_bytes[g] > 0) {
+                read_chunk(chunk.data() + g * bytes_per_ptxt, process_bytes[g]);
+            }
+            offset += process_bytes[g];
+        }
+
+        workers_->parallel_for(count, [&](uint64_t begin, uint64_t end, uint32_t) {
+            // Coefficients are written straight into the plaintext, or into
+            // one buffer per chunk in compact storage
+            vector<uint64_t> coefficients(compact_db_ ? N : 0);
+            for (uint64_t g = begin; g < end; g++) {
+                uint64_t *coeffs = coefficients.data();
+                if (!compact_db_) {
+                    (*result)[first + g].resize(N);
+                    coeffs = (*result)[first + g].data();
+                }
+
+                // Get the coefficients of the elements that will be packed in this plaintext
+                uint64_t written = 0;
+                if (process_bytes[g] > 0) {
+                    written = bytes_to_coeffs(logt, chunk.data() + g * bytes_per_ptxt,
+                                              process_bytes[g], coeffs);
+                    assert(written <= coeff_per_ptxt);
+                }
 
-    uint32_t offset = 0;
+                // Pad the rest with 1s
+                fill(coeffs + written, coeffs + N, 1);
 
-    for (uint64_t i = 0; i < total; i++) {
+                if (compact_db_) {
+                    pack_coefficients(coeffs, N, bits, packed.data() + (first + g) * words, words);
+                    continue;
+                }
+                Plaintext &plain = (*result)[first + g];
+                if (ntt) {
+                    evaluator_->transform_to_ntt_inplace(plain, context_->first_parms_id());
+                }
+            }
+        });
+    }
 
-        uint64_t process_bytes = 0;
+    PIR_LOG(LogLevel::debug, "adding: " << matrix_plaintexts - total
+            << " FV plaintexts of padding (equivalent to: "
+            << (matrix_plaintexts - total) * ele_per_ptxt << " elements)");
 
-        if (db_size <= offset) {
-            break;
-        } else if (db_size < offset + bytes_per_ptxt) {
-            process_bytes = db_size - offset;
-        } else {
-            process_bytes = bytes_per_ptxt;
-        }
+    if (compact_db_) {
+        db_.reset();
+        db_mapping_.reset();
+        db_packed_ = move(packed);
+        is_db_preprocessed_ = true;
+    } else {
+        set_database(move(result));
+        is_db_preprocessed_ = ntt;
+    }
+    ele_num_ = ele_num;
+    ele_size_ = ele_size;
+}
 
-        // Get the coefficients of the elements that will be packed in plaintext i
-        vector<uint64_t> coefficients = bytes_to_coeffs(logt, bytes.get() + offset, process_bytes);
-        offset += process_bytes;
+void PIRServer::update_elements(const vector<uint64_t> &indices, const uint8_t *bytes) {
+    if (!db_ && db_packed_.empty()) {
+        throw logic_error("only an in-memory database can be updated");
+    }
+    if (ele_size_ == 0) {
+        throw logic_error("database was not set from bytes");
+    }
 
-        uint64_t used = coefficients.size();
+    uint32_t logt = floor(log2(params_.plain_modulus().value()));
+    uint32_t N = params_.poly_modulus_degree();
+    uint64_t ele_per_ptxt = elements_per_ptxt(logt, N, ele_size_);
+    uint64_t bytes_per_ptxt = ele_per_ptxt * ele_size_;
+    uint64_t db_size = ele_num_ * ele_size_;
+
+    // Group the new elements by the FV plaintext holding them, keeping their
+    // order so that a repeated index ends up with its last value
+    map<uint64_t, vector<pair<uint64_t, const uint8_t *>>> updates;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indices[i] >= ele_num_) {
+            throw invalid_argument("element index out of range");
+        }
+        uint64_t fv_index = indices[i] / ele_per_ptxt;
+        uint64_t fv_offset = indices[i] % ele_per_ptxt;
+        updates[fv_index].emplace_back(fv_offset, bytes + i * ele_size_);
+    }
+    vector<const decltype(updates)::value_type *> work;
+    for (const auto &update : updates) {
+        work.push_back(&update);
+    }
 
-        assert(used <= coeff_per_ptxt);
+    auto parms_id = context_->first_parms_id();
+    auto context_data = context_->get_context_data(parms_id);
+    int bits = params_.plain_modulus().bit_count();
+    uint64_t words = packed_words();
+
+    workers_->parallel_for(work.size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        vector<uint8_t> buffer(bytes_per_ptxt);
+        Plaintext coeffs(N);
+        vector<uint64_t> coefficients(N);
+
+        for (uint64_t w = begin; w < end; w++) {
+            uint64_t fv_index = work[w]->first;
+            uint64_t start = fv_index * bytes_per_ptxt;
+            uint64_t process_bytes = min(bytes_per_ptxt, db_size - start);
+
+            // Recover the coefficients of the plaintext. Coefficients are below
+            // t, so the first RNS component of the NTT form holds them exactly.
+            if (!db_packed_.empty()) {
+                unpack_coefficients(db_packed_.data() + fv_index * words, N, bits, coeffs.data());
+            } else {
+                set_uint_uint((*db_)[fv_index].data(), N, coeffs.data());
+                if (is_db_preprocessed_) {
+                    inverse_ntt_negacyclic_harvey(coeffs.data(), context_data->small_ntt_tables()[0]);
+                }
+            }
 
-        // Pad the rest with 1s
-        for (uint64_t j = 0; j < (N - used); j++) {
-            coefficients.push_back(1);
+            // Patch the elements into the plaintext's bytes and encode it again
+            coeffs_to_bytes(logt, coeffs, buffer.data(), process_bytes);
+            for (const auto &element : work[w]->second) {
+                memcpy(buffer.data() + element.first * ele_size_, element.second, ele_size_);
+            }
+            if (!db_packed_.empty()) {
+                uint64_t written = bytes_to_coeffs(logt, buffer.data(), process_bytes,
+                                                   coefficients.data());
+                fill(coefficients.begin() + written, coefficients.end(), 1);
+                pack_coefficients(coefficients.data(), N, bits, db_packed_.data() + fv_index * words,
+                                  words);
+                continue;
+            }
+            Plaintext &plain = (*db_)[fv_index];
+            plain.parms_id() = parms_id_zero; // back to coefficient form, so it can be resized
+            plain.resize(N);
+            uint64_t written = bytes_to_coeffs(logt, buffer.data(), process_bytes, plain.data());
+            fill(plain.data() + written, plain.data() + N, 1);
+            if (is_db_preprocessed_) {
+                evaluator_->transform_to_ntt_inplace(plain, parms_id);
+            }
         }
+    });
+}
 
-        Plaintext plain;
-        vector_to_plaintext(coefficients, plain);
-        // cout << i << "-th encoded plaintext = " << plain.to_string() << endl; 
-        result->push_back(move(plain));
+void PIRServer::set_galois_key(std::uint32_t client_id, seal::GaloisKeys galkey) {
+    galkey.parms_id() = context_->first_parms_id();
+    galois_keys_->insert(client_id, move(galkey));
+}
+
+void PIRServer::set_galois_key(uint32_t client_id, string_view message) {
+    set_galois_key(client_id, deserialize_galoiskeys_message(context_, message));
+}
+
+PirQuery PIRServer::deserialize_query(string_view message) const {
+    PirQuery query = deserialize_query_message(context_, message);
+    if (query.size() != pir_params_.nvec.size()) {
+        throw invalid_argument("query does not match the number of dimensions");
     }
+    return query;
+}
 
-    // Add padding to make database a matrix
-    uint64_t current_plaintexts = result->size();
-    assert(current_plaintexts <= total);
+void PIRServer::set_galois_key_store(shared_ptr<GaloisKeyStore> store) {
+    if (!store) {
+        throw invalid_argument("store cannot be null");
+    }
+    galois_keys_ = move(store);
+}
 
-#ifdef DEBUG
-    cout << "adding: " << matrix_plaintexts - current_plaintexts
-         << " FV plaintexts of padding (equivalent to: "
-         << (matrix_plaintexts - current_plaintexts) * elements_per_ptxt(logtp, N, ele_size)
-         << " elements)" << endl;
-#endif
+shared_ptr<const GaloisKeys> PIRServer::galois_key(uint32_t client_id) const {
+    auto galkey = galois_keys_->find(client_id);
+    if (!galkey) {
+        throw invalid_argument("no Galois keys registered for client");
+    }
+    return galkey;
+}
 
-    vector<uint64_t> padding(N, 1);
+namespace {
 
-    for (uint64_t i = 0; i < (matrix_plaintexts - current_plaintexts); i++) {
-        Plaintext plain;
-        vector_to_plaintext(padding, plain);
-        result->push_back(plain);
+// Grows v to at least n elements, adding any reallocation to bytes
+template <typename T>
+void grow(vector<T> &v, size_t n, atomic<size_t> &bytes) {
+    if (v.size() >= n) {
+        return;
     }
+    size_t capacity = v.capacity();
+    v.resize(n);
+    bytes += (v.capacity() - capacity) * sizeof(T);
+}
 
-    set_database(move(result));
+// Same for SEAL objects: new ones allocate from pool and are set up by init
+template <typename T, typename Init>
+void grow(vector<T> &v, size_t n, const MemoryPoolHandle &pool, atomic<size_t> &bytes,
+          const Init &init) {
+    if (v.size() >= n) {
+        return;
+    }
+    size_t capacity = v.capacity();
+    v.reserve(n);
+    while (v.size() < n) {
+        v.emplace_back(pool);
+        init(v.back());
+    }
+    bytes += (v.capacity() - capacity) * sizeof(T);
 }
 
-void PIRServer::set_galois_key(std::uint32_t client_id, seal::GaloisKeys galkey) {
-    galkey.parms_id() = context_->first_parms_id();
-    galoisKeys_[client_id] = galkey;
+} // namespace
+
+PIRServer::Workspace *PIRServer::acquire_workspace() {
+    lock_guard<mutex> lock(workspace_mutex_);
+    if (free_workspaces_.empty()) {
+        workspaces_.push_back(make_unique<Workspace>());
+        Workspace *ws = workspaces_.back().get();
+        ws->pool = MemoryPoolHandle::New();
+        ws->vector_bytes = 0;
+        ws->threads = 1;
+        // so that release_workspace never has to grow it
+        free_workspaces_.reserve(workspaces_.size());
+        return ws;
+    }
+    Workspace *ws = free_workspaces_.back();
+    free_workspaces_.pop_back();
+    return ws;
 }
 
-PirReply PIRServer::generate_reply(PirQuery query, uint32_t client_id) {
+void PIRServer::release_workspace(Workspace *ws) {
+    lock_guard<mutex> lock(workspace_mutex_);
+    free_workspaces_.push_back(ws);
+}
 
-    vector<uint64_t> nvec = pir_params_.nvec;
-    uint64_t product = 1;
+// Makes sure ws can hold a reply computation for batch queries. Only the first
+// use (or a larger batch, or more threads) allocates anything.
+void PIRServer::prepare_workspace(Workspace &ws, size_t batch) {
+    auto parms_id = context_->first_parms_id();
+    uint64_t N = params_.poly_modulus_degree();
+    size_t coeff_mod_count = context_->get_context_data(parms_id)->parms().coeff_modulus().size();
+    const auto &nvec = pir_params_.nvec;
+    uint32_t threads = workers_->num_threads();
 
+    // Largest dimension, output and decomposition over the levels of a reply
+    uint64_t product = 1;
+    for (auto n : nvec) {
+        product *= n;
+    }
+    uint64_t max_n = 0;
+    uint64_t max_columns = 0;
+    uint64_t max_decomposed = 0;
+    uint64_t columns = product;
     for (uint32_t i = 0; i < nvec.size(); i++) {
-        product *= nvec[i];
+        if (i > 0) {
+            columns *= pir_params_.expansion_ratio;
+            max_decomposed = max(max_decomposed, columns);
+        }
+        max_n = max(max_n, nvec[i]);
+        columns /= nvec[i];
+        max_columns = max(max_columns, columns);
     }
 
-    auto coeff_count = params_.poly_modulus_degree();
+    auto reserve_ciphertext = [&](Ciphertext &ct) { ct.reserve(context_, parms_id, 2); };
+    auto reserve_plaintext = [&](Plaintext &plain) { plain.reserve(N * coeff_mod_count); };
 
-    vector<Plaintext> *cur = db_.get();
-    vector<Plaintext> intermediate_plain; // decompose....
+    grow(ws.expanded, batch, ws.vector_bytes);
+    grow(ws.intermediate, batch, ws.vector_bytes);
+    for (size_t b = 0; b < batch; b++) {
+        grow(ws.expanded[b], max_n, ws.pool, ws.vector_bytes, reserve_ciphertext);
+        grow(ws.intermediate[b], max_columns, ws.pool, ws.vector_bytes, reserve_ciphertext);
+    }
+    // Only decompositions are held in intermediate_plain; the database is
+    // merely pointed at
+    grow(ws.intermediate_plain, max_decomposed, ws.pool, ws.vector_bytes, reserve_plaintext);
+
+    grow(ws.scratch, threads, ws.vector_bytes);
+    grow(ws.column, threads, ws.vector_bytes);
+    grow(ws.destination, threads, ws.vector_bytes);
+    for (uint32_t t = 0; t < threads; t++) {
+        grow(ws.scratch[t], 2, ws.pool, ws.vector_bytes, reserve_ciphertext);
+        grow(ws.column[t], max_n, ws.vector_bytes);
+        grow(ws.destination[t], batch, ws.vector_bytes);
+    }
+    grow(ws.plains, max(product, max_decomposed), ws.vector_bytes);
+    grow(ws.encrypted, batch, ws.vector_bytes);
+
+    if (compact_db_) {
+        grow(ws.ntt_block, threads, ws.vector_bytes);
+        grow(ws.encrypted_block, threads, ws.vector_bytes);
+        for (uint32_t t = 0; t < threads; t++) {
+            grow(ws.ntt_block[t], compact_block_terms() * N * coeff_mod_count, ws.vector_bytes);
+            grow(ws.encrypted_block[t], batch, ws.vector_bytes);
+        }
+    }
+}
 
-    auto pool = MemoryManager::GetPool();
+size_t PIRServer::workspace_bytes() const {
+    lock_guard<mutex> lock(workspace_mutex_);
+    size_t bytes = 0;
+    for (const auto &ws : workspaces_) {
+        bytes += ws->pool.alloc_byte_count() + ws->vector_bytes;
+    }
+    return bytes;
+}
 
+PirReply PIRServer::generate_reply(const PirQuery &query, uint32_t client_id) {
+    PirReply reply;
+    generate_reply(query, client_id, reply);
+    return reply;
+}
 
-    int N = params_.poly_modulus_degree();
+void PIRServer::generate_reply(const PirQuery &query, uint32_t client_id, PirReply &reply,
+                               uint32_t max_threads) {
+    const PirQuery *queries = &query;
+    PirReply *replies = &reply;
+    reply_batch(&queries, &client_id, 1, &replies, max_threads);
+}
 
-    int logt = floor(log2(params_.plain_modulus().value()));
+vector<PirReply> PIRServer::generate_replies(const vector<PirQuery> &queries,
+                                             const vector<uint32_t> &client_ids) {
+    if (queries.size() != client_ids.size()) {
+        throw invalid_argument("need one client id per query");
+    }
 
-    cout << "expansion ratio = " << pir_params_.expansion_ratio << endl; 
-    for (uint32_t i = 0; i < nvec.size(); i++) {
-        cout << "Server: " << i + 1 << "-th recursion level started " << endl; 
+    vector<PirReply> replies(queries.size());
+    vector<const PirQuery *> query_ptrs(queries.size());
+    vector<PirReply *> reply_ptrs(queries.size());
+    for (size_t b = 0; b < queries.size(); b++) {
+        query_ptrs[b] = &queries[b];
+        reply_ptrs[b] = &replies[b];
+    }
+    reply_batch(query_ptrs.data(), client_ids.data(), queries.size(), reply_ptrs.data(), 0);
+    return replies;
+}
 
+namespace {
 
-        vector<Ciphertext> expanded_query; 
+// Adds the operations of expanding a dimension of n_i entries to stats
+void count_expansion(ReplyStats &stats, uint64_t N, uint64_t n_i) {
+    // a tree over m leaves takes m - 1 Galois automorphisms
+    uint64_t ctxts = (n_i + N - 1) / N;
+    stats.galois_applications += n_i - ctxts;
+    stats.ntt_transforms += n_i;
+}
 
-        uint64_t n_i = nvec[i];
-        cout << "Server: n_i = " << n_i << endl; 
-        cout << "Server: expanding " << query[i].size() << " query ctxts" << endl;
-        for (uint32_t j = 0; j < query[i].size(); j++){
-            uint64_t total = N; 
-            if (j == query[i].size() - 1){
-                total = n_i % N; 
-            }
-            cout << "-- expanding one query ctxt into " << total  << " ctxts "<< endl;
-            vector<Ciphertext> expanded_query_part = expand_query(query[i][j], total, client_id);
-            expanded_query.insert(expanded_query.end(), std::make_move_iterator(expanded_query_part.begin()), 
-                    std::make_move_iterator(expanded_query_part.end()));
-            expanded_query_part.clear(); 
-        }
-        cout << "Server: expansion done " << endl; 
-        if (expanded_query.size() != n_i) {
-            cout << " size mismatch!!! " << expanded_query.size() << ", " << n_i << endl; 
-        }    
-
-        /*
-        cout << "Checking expanded query " << endl; 
-        Plaintext tempPt; 
-        for (int h = 0 ; h < expanded_query.size(); h++){
-            cout << "noise budget = " << client.decryptor_->invariant_noise_budget(expanded_query[h]) << ", "; 
-            client.decryptor_->decrypt(expanded_query[h], tempPt); 
-            cout << tempPt.to_string()  << endl; 
-        }
-        cout << endl;
-        */
+// Counters of a reply computation over d dimensions, before its first step
+void reset_stats(ReplyStats &stats, size_t batch, size_t d) {
+    stats.queries = batch;
+    stats.total = chrono::nanoseconds::zero();
+    stats.levels.assign(d, ReplyLevelStats());
+    stats.galois_applications = 0;
+    stats.plain_multiplications = 0;
+    stats.ntt_transforms = 0;
+    stats.inverse_ntt_transforms = 0;
+}
 
-        // Transform expanded query to NTT, and ...
-        for (uint32_t jj = 0; jj < expanded_query.size(); jj++) {
-            evaluator_->transform_to_ntt_inplace(expanded_query[jj]);
-        }
+} // namespace
 
-        // Transform plaintext to NTT. If database is pre-processed, can skip
-        if ((!is_db_preprocessed_) || i > 0) {
-            for (uint32_t jj = 0; jj < cur->size(); jj++) {
-                evaluator_->transform_to_ntt_inplace((*cur)[jj],
-                    context_->first_parms_id());
-            }
-        }
+void PIRServer::generate_partial_reply(const vector<Ciphertext> &query, uint64_t first_row,
+                                       uint64_t total_rows, uint32_t client_id,
+                                       vector<Ciphertext> &partial) {
+    if (!db_ && !db_mapping_ && db_packed_.empty()) {
+        throw logic_error("database is not set");
+    }
+    const auto &nvec = pir_params_.nvec;
+    uint64_t rows = nvec[0];
+    if (first_row >= total_rows || rows > total_rows - first_row) {
+        throw invalid_argument("rows are outside the first dimension");
+    }
+    preprocess_database();
 
-        for (uint64_t k = 0; k < product; k++) {
-            if ((*cur)[k].is_zero()){
-                cout << k + 1 << "/ " << product <<  "-th ptxt = 0 " << endl; 
-            }
-        }
+    uint64_t columns = 1;
+    for (uint32_t i = 1; i < nvec.size(); i++) {
+        columns *= nvec[i];
+    }
 
-        product /= n_i;
+    WorkspaceLease lease{*this, acquire_workspace()};
+    Workspace &ws = *lease.ws;
+    prepare_workspace(ws, 1);
+    ws.threads = workers_->num_threads();
+
+    expand_rows(query, total_rows, first_row, rows, client_id, ws.expanded[0].data(), ws);
+    if (!db_packed_.empty()) {
+        multiply_compact_dimension(ws, 1, rows, columns);
+    } else {
+        database_pointers(ws);
+        multiply_dimension(ws, 1, 0, rows, columns);
+    }
+    // Left at the query's level: switching each shard's share down would add
+    // one rounding error per shard to the sum, so finish_reply switches it
+    transform_intermediate_from_ntt(ws, 1, 0, columns, false);
 
-        vector<Ciphertext> intermediateCtxts(product);
-        Ciphertext temp;
+    partial.resize(columns);
+    for (uint64_t k = 0; k < columns; k++) {
+        partial[k] = ws.intermediate[0][k];
+    }
+}
 
-        for (uint64_t k = 0; k < product; k++) {
+void PIRServer::finish_reply(const PirQuery &query, uint32_t client_id,
+                             const vector<Ciphertext> &intermediate, PirReply &reply) {
+    const auto &nvec = pir_params_.nvec;
+    if (query.size() != nvec.size()) {
+        throw invalid_argument("query does not match the number of dimensions");
+    }
+    uint64_t columns = 1;
+    for (uint32_t i = 1; i < nvec.size(); i++) {
+        columns *= nvec[i];
+    }
+    if (intermediate.size() != columns) {
+        throw invalid_argument("first dimension results do not match the dimensions");
+    }
 
-            evaluator_->multiply_plain(expanded_query[0], (*cur)[k], intermediateCtxts[k]);
+    WorkspaceLease lease{*this, acquire_workspace()};
+    Workspace &ws = *lease.ws;
+    prepare_workspace(ws, 1);
+    ws.threads = workers_->num_threads();
+    reset_stats(ws.stats, 1, nvec.size());
 
-            for (uint64_t j = 1; j < n_i; j++) {
-                evaluator_->multiply_plain(expanded_query[j], (*cur)[k + j * product], temp);
-                evaluator_->add_inplace(intermediateCtxts[k], temp); // Adds to first component.
-            }
-        }
+    for (uint64_t k = 0; k < columns; k++) {
+        ws.intermediate[0][k] = intermediate[k];
+    }
+    if (pir_params_.mod_switch) {
+        mod_switch_intermediate(ws, 1, 0, columns);
+    }
+    Stopwatch watch(false);
+    reply_remaining_dimensions(ws, query, client_id, 0, columns, reply, watch);
+}
+
+void PIRServer::reply_batch(const PirQuery *const *queries, const uint32_t *client_ids,
+                            size_t batch, PirReply *const *replies, uint32_t max_threads) {
+    if (!db_ && !db_mapping_ && db_packed_.empty()) {
+        throw logic_error("database is not set");
+    }
 
-        for (uint32_t jj = 0; jj < intermediateCtxts.size(); jj++) {
-            evaluator_->transform_from_ntt_inplace(intermediateCtxts[jj]);
-            // print intermediate ctxts? 
-            //cout << "const term of ctxt " << jj << " = " << intermediateCtxts[jj][0] << endl; 
+    const auto &nvec = pir_params_.nvec;
+    for (size_t b = 0; b < batch; b++) {
+        if (queries[b]->size() != nvec.size()) {
+            throw invalid_argument("query does not match the number of dimensions");
         }
+    }
+    if (batch == 0) {
+        return;
+    }
 
-        if (i == nvec.size() - 1) {
-            return intermediateCtxts;
-        } else {
-            intermediate_plain.clear();
-            intermediate_plain.reserve(pir_params_.expansion_ratio * product);
-            cur = &intermediate_plain;
+    // The database is only transformed to NTT once, even if the caller skipped it
+    preprocess_database();
 
-            auto tempplain = util::allocate<Plaintext>(
-                pir_params_.expansion_ratio * product,
-                pool, coeff_count);
+    uint64_t product = 1;
+    for (uint32_t i = 0; i < nvec.size(); i++) {
+        product *= nvec[i];
+    }
+
+    WorkspaceLease lease{*this, acquire_workspace()};
+    Workspace &ws = *lease.ws;
+    prepare_workspace(ws, batch);
+    ws.threads = workers_->num_threads();
+    if (max_threads != 0) {
+        ws.threads = min(ws.threads, max_threads);
+    }
 
-            for (uint64_t rr = 0; rr < product; rr++) {
+    PIR_LOG(LogLevel::debug, "Server: answering " << batch << " queries");
 
-                decompose_to_plaintexts_ptr(intermediateCtxts[rr],
-                    tempplain.get() + rr * pir_params_.expansion_ratio, logt);
+    // Timings are only taken with an observer; the counts are nearly free
+    ReplyStats &stats = ws.stats;
+    reset_stats(stats, batch, nvec.size());
+    Stopwatch watch(static_cast<bool>(reply_observer_));
+    Stopwatch total_watch(static_cast<bool>(reply_observer_));
 
-                for (uint32_t jj = 0; jj < pir_params_.expansion_ratio; jj++) {
-                    auto offset = rr * pir_params_.expansion_ratio + jj;
-                    intermediate_plain.emplace_back(tempplain[offset]);
-                }
-            }
-            product *= pir_params_.expansion_ratio; // multiply by expansion rate.
+    uint64_t N = params_.poly_modulus_degree();
+
+    // First dimension: expand every query of the batch, then make a single pass
+    // over the database, multiplying each plaintext with all expanded queries.
+    uint32_t max_chunks = (batch >= ws.threads) ? ws.threads : 1;
+    workers_->parallel_for(batch, [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t b = begin; b < end; b++) {
+            expand_dimension((*queries[b])[0], nvec[0], client_ids[b], ws.expanded[b].data(), ws);
         }
-        cout << "Server: " << i + 1 << "-th recursion level finished " << endl; 
-        cout << endl;
+    }, max_chunks);
+    watch.lap(stats.levels[0].expansion);
+
+    product /= nvec[0];
+    if (!db_packed_.empty()) {
+        multiply_compact_dimension(ws, batch, nvec[0], product);
+        stats.ntt_transforms += nvec[0] * product;
+    } else {
+        database_pointers(ws);
+        multiply_dimension(ws, batch, 0, nvec[0], product);
+    }
+    watch.lap(stats.levels[0].inner_product);
+
+    transform_intermediate_from_ntt(ws, batch, 0, product, pir_params_.mod_switch);
+    watch.lap(stats.levels[0].inverse_ntt);
+
+    for (size_t b = 0; b < batch; b++) {
+        count_expansion(stats, N, nvec[0]);
+    }
+    stats.plain_multiplications += batch * nvec[0] * product;
+    stats.inverse_ntt_transforms += batch * product;
+
+    // The remaining dimensions only touch each query's own intermediate result
+    for (size_t b = 0; b < batch; b++) {
+        reply_remaining_dimensions(ws, *queries[b], client_ids[b], b, product, *replies[b],
+                                   watch);
+    }
+
+    PIR_LOG(LogLevel::debug, "Server: replies generated");
+    if (reply_observer_) {
+        total_watch.lap(stats.total);
+        reply_observer_(stats);
     }
-    cout << "reply generated!  " << endl;
-    // This should never get here
-    assert(0);
-    vector<Ciphertext> fail(1);
-    return fail;
 }
 
-inline vector<Ciphertext> PIRServer::expand_query(const Ciphertext &encrypted, uint32_t m,
-                                           uint32_t client_id) {
+void PIRServer::reply_remaining_dimensions(Workspace &ws, const PirQuery &query,
+                                           uint32_t client_id, size_t b, uint64_t columns,
+                                           PirReply &reply, Stopwatch &watch) {
+    const auto &nvec = pir_params_.nvec;
+    ReplyStats &stats = ws.stats;
+    uint64_t N = params_.poly_modulus_degree();
+
+    for (uint32_t i = 1; i < nvec.size(); i++) {
+        ReplyLevelStats &level = stats.levels[i];
+
+        decompose_to_ntt_plaintexts(ws, ws.intermediate[b].data(), columns);
+        columns *= pir_params_.expansion_ratio; // multiply by expansion rate.
+        stats.ntt_transforms += columns;
+        watch.lap(level.decomposition);
+
+        expand_dimension(query[i], nvec[i], client_id, ws.expanded[0].data(), ws);
+        watch.lap(level.expansion);
+        count_expansion(stats, N, nvec[i]);
+
+        columns /= nvec[i];
+        multiply_dimension(ws, 1, b, nvec[i], columns);
+        watch.lap(level.inner_product);
+        transform_intermediate_from_ntt(ws, 1, b, columns, pir_params_.mod_switch);
+        watch.lap(level.inverse_ntt);
+        stats.plain_multiplications += nvec[i] * columns;
+        stats.inverse_ntt_transforms += columns;
+    }
 
-#ifdef DEBUG
-    uint64_t plainMod = params_.plain_modulus().value();
-    cout << "PIRServer side plain modulus = " << plainMod << endl;
-#endif
+    reply.resize(columns);
+    for (uint64_t k = 0; k < columns; k++) {
+        reply[k] = ws.intermediate[b][k];
+    }
+}
 
-    GaloisKeys &galkey = galoisKeys_[client_id];
+// With mod_switch, also switches the results to the last level before they
+// are returned or decomposed for the next dimension
+void PIRServer::transform_intermediate_from_ntt(Workspace &ws, size_t batch, size_t first_output,
+                                                uint64_t columns, bool mod_switch) {
+    auto last_parms_id = context_->last_parms_id();
+    workers_->parallel_for(batch * columns, [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t jj = begin; jj < end; jj++) {
+            Ciphertext &result = ws.intermediate[first_output + jj / columns][jj % columns];
+            evaluator_->transform_from_ntt_inplace(result);
+            if (mod_switch) {
+                evaluator_->mod_switch_to_inplace(result, last_parms_id, ws.pool);
+            }
+        }
+    }, ws.threads);
+}
 
-    // Assume that m is a power of 2. If not, round it to the next power of 2.
-    uint32_t logm = ceil(log2(m));
-    Plaintext two("2");
+void PIRServer::mod_switch_intermediate(Workspace &ws, size_t batch, size_t first_output,
+                                        uint64_t columns) {
+    auto last_parms_id = context_->last_parms_id();
+    workers_->parallel_for(batch * columns, [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t jj = begin; jj < end; jj++) {
+            Ciphertext &result = ws.intermediate[first_output + jj / columns][jj % columns];
+            evaluator_->mod_switch_to_inplace(result, last_parms_id, ws.pool);
+        }
+    }, ws.threads);
+}
 
-    vector<int> galois_elts;
-    auto n = params_.poly_modulus_degree();
-    if (logm > ceil(log2(n))){
-        throw logic_error("m > n is not allowed."); 
+void PIRServer::expand_dimension(const vector<Ciphertext> &query, uint64_t n_i,
+                                 uint32_t client_id, Ciphertext *destination, Workspace &ws) {
+    uint64_t N = params_.poly_modulus_degree();
+    if (query.empty() || (query.size() - 1) * N >= n_i || query.size() * N < n_i) {
+        throw invalid_argument("query does not expand to the dimension size");
     }
-    for (int i = 0; i < ceil(log2(n)); i++) {
-        galois_elts.push_back((n + exponentiate_uint64(2, i)) / exponentiate_uint64(2, i));
+    // Held until the expansion is done, even if the store evicts the keys
+    auto galkey = galois_key(client_id);
+
+    // With enough query ctxts to keep every thread busy, expand them side by
+    // side (each expansion then runs serially). Otherwise expand one at a
+    // time and let expand_query spread each tree level across the threads.
+    uint32_t max_chunks = (query.size() >= ws.threads) ? ws.threads : 1;
+    workers_->parallel_for(query.size(), [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t j = begin; j < end; j++) {
+            // every ctxt but the last one selects among N entries
+            uint64_t total = N;
+            if (j == query.size() - 1) {
+                total = n_i - N * j;
+            }
+            expand_query(query[j], total, *galkey, destination + N * j, ws, true);
+        }
+    }, max_chunks);
+}
+
+// Expands rows [first_row, first_row + rows) of a dimension of total_rows
+// entries. Only the query ctxts covering those rows are expanded.
+void PIRServer::expand_rows(const vector<Ciphertext> &query, uint64_t total_rows,
+                            uint64_t first_row, uint64_t rows, uint32_t client_id,
+                            Ciphertext *destination, Workspace &ws) {
+    uint64_t N = params_.poly_modulus_degree();
+    if (query.empty() || (query.size() - 1) * N >= total_rows || query.size() * N < total_rows) {
+        throw invalid_argument("query does not expand to the dimension size");
     }
+    auto galkey = galois_key(client_id);
+
+    uint64_t first_ctxt = first_row / N;
+    uint64_t ctxts = (first_row + rows - 1) / N + 1 - first_ctxt;
+    uint32_t max_chunks = (ctxts >= ws.threads) ? ws.threads : 1;
+    workers_->parallel_for(ctxts, [&](uint64_t begin, uint64_t end, uint32_t) {
+        vector<Ciphertext> leaves;
+        for (uint64_t j = first_ctxt + begin; j < first_ctxt + end; j++) {
+            uint64_t total = min(N, total_rows - N * j);
+            leaves.resize(total);
+            expand_query(query[j], total, *galkey, leaves.data(), ws, true);
+
+            uint64_t from = max(first_row, N * j);
+            uint64_t to = min(first_row + rows, N * j + total);
+            for (uint64_t r = from; r < to; r++) {
+                destination[r - first_row] = move(leaves[r - N * j]);
+            }
+        }
+    }, max_chunks);
+}
 
-    vector<Ciphertext> temp;
-    temp.push_back(encrypted);
-    Ciphertext tempctxt;
-    Ciphertext tempctxt_rotated;
-    Ciphertext tempctxt_shifted;
-    Ciphertext tempctxt_rotatedshifted;
+void PIRServer::multiply_dimension(Workspace &ws, size_t batch, size_t first_output,
+                                   uint64_t n_i, uint64_t columns) {
+    auto N = params_.poly_modulus_degree();
+    auto parms_id = ws.expanded[0][0].parms_id();
+    auto encrypted_count = ws.expanded[0][0].size();
+    const auto &coeff_modulus = context_->get_context_data(parms_id)->parms().coeff_modulus();
 
+    for (size_t b = 0; b < batch; b++) {
+        ws.encrypted[b] = ws.expanded[b].data();
+    }
+    vector<Ciphertext> *result = ws.intermediate.data() + first_output;
+
+    // Each thread computes a contiguous range of output columns k. The
+    // dot product reduces each coefficient once at the end, which gives the
+    // same result as a multiply_plain and add_inplace per term.
+    workers_->parallel_for(columns, [&](uint64_t begin, uint64_t end, uint32_t chunk) {
+        // Plaintexts of the current column and outputs of the batch
+        const uint64_t **column = ws.column[chunk].data();
+        Ciphertext **destination = ws.destination[chunk].data();
+
+        for (uint64_t k = begin; k < end; k++) {
+            for (uint64_t j = 0; j < n_i; j++) {
+                column[j] = ws.plains[k + j * columns];
+            }
+            for (size_t b = 0; b < batch; b++) {
+                result[b][k].resize(context_, parms_id, encrypted_count);
+                result[b][k].is_ntt_form() = true;
+                destination[b] = &result[b][k];
+            }
+            dot_product_ntt(ws.encrypted.data(), batch, column, n_i, coeff_modulus, N,
+                            destination);
+        }
+    }, ws.threads);
+}
 
-    for (uint32_t i = 0; i < logm - 1; i++) {
-        vector<Ciphertext> newtemp(temp.size() << 1);
-        // temp[a] = (j0 = a (mod 2**i) ? ) : Enc(x^{j0 - a}) else Enc(0).  With
-        // some scaling....
-        int index_raw = (n << 1) - (1 << i);
-        int index = (index_raw * galois_elts[i]) % (n << 1);
+// First dimension in compact storage: the n_i plaintexts of each column are
+// unpacked and transformed to NTT a block at a time into the thread's buffer,
+// and each block is accumulated into the outputs of the whole batch.
+void PIRServer::multiply_compact_dimension(Workspace &ws, size_t batch, uint64_t n_i,
+                                           uint64_t columns) {
+    auto N = params_.poly_modulus_degree();
+    auto parms_id = ws.expanded[0][0].parms_id();
+    auto encrypted_count = ws.expanded[0][0].size();
+    const auto &coeff_modulus = context_->get_context_data(parms_id)->parms().coeff_modulus();
+    uint64_t plaintext_words = N * coeff_modulus.size();
+    uint64_t words = packed_words();
+    uint64_t block_terms = min(n_i, compact_block_terms());
+
+    if (db_packed_.size() < n_i * columns * words) {
+        throw logic_error("database is smaller than the dimensions require");
+    }
 
-        for (uint32_t a = 0; a < temp.size(); a++) {
+    workers_->parallel_for(columns, [&](uint64_t begin, uint64_t end, uint32_t chunk) {
+        uint64_t *block = ws.ntt_block[chunk].data();
+        const uint64_t **column = ws.column[chunk].data();
+        const Ciphertext **encrypted = ws.encrypted_block[chunk].data();
+        Ciphertext **destination = ws.destination[chunk].data();
+
+        for (uint64_t k = begin; k < end; k++) {
+            for (size_t b = 0; b < batch; b++) {
+                ws.intermediate[b][k].resize(context_, parms_id, encrypted_count);
+                ws.intermediate[b][k].is_ntt_form() = true;
+                destination[b] = &ws.intermediate[b][k];
+            }
+            for (uint64_t j0 = 0; j0 < n_i; j0 += block_terms) {
+                uint64_t len = min(block_terms, n_i - j0);
+                for (uint64_t j = 0; j < len; j++) {
+                    column[j] = block + j * plaintext_words;
+                    unpack_to_ntt(db_packed_.data() + (k + (j0 + j) * columns) * words,
+                                  block + j * plaintext_words);
+                }
+                for (size_t b = 0; b < batch; b++) {
+                    encrypted[b] = ws.expanded[b].data() + j0;
+                }
+                dot_product_ntt(encrypted, batch, column, len, coeff_modulus, N, destination,
+                                j0 > 0);
+            }
+        }
+    }, ws.threads);
+}
 
-            evaluator_->apply_galois(temp[a], galois_elts[i], galkey, tempctxt_rotated);
+void PIRServer::database_pointers(Workspace &ws) {
+    uint64_t product = 1;
+    for (auto n : pir_params_.nvec) {
+        product *= n;
+    }
 
-            //cout << "rotate " << client.decryptor_->invariant_noise_budget(tempctxt_rotated) << ", "; 
+    if (db_) {
+        if (db_->size() < product) {
+            throw logic_error("database is smaller than the dimensions require");
+        }
+        for (uint64_t i = 0; i < product; i++) {
+            if ((*db_)[i].parms_id() != context_->first_parms_id()) {
+                throw logic_error("plaintext is not in NTT form");
+            }
+            ws.plains[i] = (*db_)[i].data();
+        }
+        return;
+    }
 
-            evaluator_->add(temp[a], tempctxt_rotated, newtemp[a]);
-            multiply_power_of_X(temp[a], tempctxt_shifted, index_raw);
+    auto parms_id = context_->first_parms_id();
+    uint64_t plaintext_words = params_.poly_modulus_degree() *
+        context_->get_context_data(parms_id)->parms().coeff_modulus().size();
+    const uint64_t *data = reinterpret_cast<const uint64_t *>(db_mapping_.get() + db_mapping_offset_);
+    for (uint64_t i = 0; i < product; i++) {
+        ws.plains[i] = data + i * plaintext_words;
+    }
+}
+
+// Decomposes count ciphertexts into the workspace's plaintexts, which keep
+// their buffers between calls, and points ws.plains at them.
+void PIRServer::decompose_to_ntt_plaintexts(Workspace &ws, const Ciphertext *encrypted,
+                                            uint64_t count) {
+    auto coeff_count = params_.poly_modulus_degree();
+    int logt = floor(log2(params_.plain_modulus().value()));
+    uint64_t ratio = pir_params_.expansion_ratio;
+    auto parms_id = context_->first_parms_id();
+
+    workers_->parallel_for(count, [&](uint64_t begin, uint64_t end, uint32_t) {
+        for (uint64_t rr = begin; rr < end; rr++) {
+            Plaintext *plains = ws.intermediate_plain.data() + rr * ratio;
+            for (uint64_t jj = 0; jj < ratio; jj++) {
+                plains[jj].parms_id() = parms_id_zero; // back to coefficient form
+                plains[jj].resize(coeff_count);
+            }
+            decompose_to_plaintexts_ptr(encrypted[rr], plains, logt);
+            for (uint64_t jj = 0; jj < ratio; jj++) {
+                evaluator_->transform_to_ntt_inplace(plains[jj], parms_id, ws.pool);
+            }
+        }
+    }, ws.threads);
 
-            //cout << "mul by x^pow: " << client.decryptor_->invariant_noise_budget(tempctxt_shifted) << ", "; 
+    for (uint64_t i = 0; i < ratio * count; i++) {
+        ws.plains[i] = ws.intermediate_plain[i].data();
+    }
+}
 
+vector<Ciphertext> PIRServer::expand_query(const Ciphertext &encrypted, uint32_t m,
+                                           uint32_t client_id) {
+    auto galkey = galois_key(client_id);
+    WorkspaceLease lease{*this, acquire_workspace()};
+    prepare_workspace(*lease.ws, 1);
+    lease.ws->threads = workers_->num_threads();
 
-            multiply_power_of_X(tempctxt_rotated, tempctxt_rotatedshifted, index);
+    vector<Ciphertext> result(m);
+    expand_query(encrypted, m, *galkey, result.data(), *lease.ws, false);
+    return result;
+}
 
-            // cout << "mul by x^pow: " << client.decryptor_->invariant_noise_budget(tempctxt_rotatedshifted) << ", "; 
+void PIRServer::expand_query(const Ciphertext &encrypted, uint32_t m, const GaloisKeys &galkey,
+                             Ciphertext *destination, Workspace &ws, bool ntt_output) {
 
+    PIR_LOG(LogLevel::debug, "PIRServer side plain modulus = " << params_.plain_modulus().value());
 
-            // Enc(2^i x^j) if j = 0 (mod 2**i).
-            evaluator_->add(tempctxt_shifted, tempctxt_rotatedshifted, newtemp[a + temp.size()]);
-        }
-        temp = newtemp;
-        /*
-        cout << "end: "; 
-        for (int h = 0; h < temp.size();h++){
-            cout << client.decryptor_->invariant_noise_budget(temp[h]) << ", "; 
-        }
-        cout << endl; 
-        */
-    }
-    // Last step of the loop
-    vector<Ciphertext> newtemp(temp.size() << 1);
-    int index_raw = (n << 1) - (1 << (logm - 1));
-    int index = (index_raw * galois_elts[logm - 1]) % (n << 1);
-    for (uint32_t a = 0; a < temp.size(); a++) {
-        if (a >= (m - (1 << (logm - 1)))) {                       // corner case.
-            evaluator_->multiply_plain(temp[a], two, newtemp[a]); // plain multiplication by 2.
-            // cout << client.decryptor_->invariant_noise_budget(newtemp[a]) << ", "; 
-        } else {
-            evaluator_->apply_galois(temp[a], galois_elts[logm - 1], galkey, tempctxt_rotated);
-            evaluator_->add(temp[a], tempctxt_rotated, newtemp[a]);
-            multiply_power_of_X(temp[a], tempctxt_shifted, index_raw);
-            multiply_power_of_X(tempctxt_rotated, tempctxt_rotatedshifted, index);
-            evaluator_->add(tempctxt_shifted, tempctxt_rotatedshifted, newtemp[a + temp.size()]);
-        }
+    if (m == 0) {
+        throw invalid_argument("cannot expand a query into zero ciphertexts");
     }
+    // The tree has ceil(log2 m) levels, pruned to the nodes with leaves below m
+    uint32_t logm = ceil(log2(m));
+    if (logm > galois_elts_.size()) {
+        throw logic_error("m > n is not allowed.");
+    }
+    auto n = params_.poly_modulus_degree();
 
-    vector<Ciphertext>::const_iterator first = newtemp.begin();
-    vector<Ciphertext>::const_iterator last = newtemp.begin() + m;
-    vector<Ciphertext> newVec(first, last);
-    return newVec;
+    // The tree is built in place: node a of a level is overwritten by its
+    // first child and its second child goes to a + size. Nodes of a level
+    // only touch their own entries, so they are split across the threads.
+    // Levels stay in order since each one consumes the previous level's output.
+    //
+    // A node whose second child is m or more only has leaves past m below
+    // that child, and the client's coefficients there are zero, so the node
+    // is left as it is: its first child is the node itself, one doubling
+    // short (see expansion_depth). Only the last level has such nodes.
+    //
+    // With ntt_output the leaves come out in NTT form for the inner product.
+    // Galois automorphisms of BFV ctxts work in coefficient form, so every
+    // level but the last stays there; the last one transforms each leaf right
+    // after computing it, while it is still in cache.
+    destination[0] = encrypted;
+    if (ntt_output && logm == 0) {
+        evaluator_->transform_to_ntt_inplace(destination[0]);
+    }
+    for (uint32_t i = 0; i < logm; i++) {
+        uint64_t size = uint64_t(1) << i;
+        uint64_t active = min(size, m - size);
+        bool transform = ntt_output && i == logm - 1;
+        // destination[a] = (j0 = a (mod 2**i) ? ) : Enc(x^{j0 - a}) else Enc(0).
+        // With some scaling....
+        int index_raw = (n << 1) - (1 << i);
+        int index = (index_raw * galois_elts_[i]) % (n << 1);
+
+        // The nodes past active are only transformed
+        workers_->parallel_for(transform ? size : active, [&](uint64_t begin, uint64_t end,
+                                                             uint32_t) {
+            vector<Ciphertext> &scratch = ws.scratch[workers_->thread_index()];
+            Ciphertext &rotated = scratch[0];
+            Ciphertext &rotatedshifted = scratch[1];
+
+            for (uint64_t a = begin; a < end; a++) {
+                if (a < active) {
+                    evaluator_->apply_galois(destination[a], galois_elts_[i], galkey, rotated,
+                                             ws.pool);
+                    multiply_power_of_X(destination[a], destination[a + size], index_raw);
+                    multiply_power_of_X(rotated, rotatedshifted, index);
+                    // Enc(2^i x^j) if j = 0 (mod 2**i).
+                    evaluator_->add_inplace(destination[a + size], rotatedshifted);
+                    evaluator_->add_inplace(destination[a], rotated);
+                    if (transform) {
+                        evaluator_->transform_to_ntt_inplace(destination[a + size]);
+                    }
+                }
+                if (transform) {
+                    evaluator_->transform_to_ntt_inplace(destination[a]);
+                }
+            }
+        }, ws.threads);
+    }
 }
 
-inline void PIRServer::multiply_power_of_X(const Ciphertext &encrypted, Ciphertext &destination,
+void PIRServer::multiply_power_of_X(const Ciphertext &encrypted, Ciphertext &destination,
                                     uint32_t index) {
 
-    auto coeff_mod_count = params_.coeff_modulus().size();
+    // The moduli of the ciphertext's own level, which has no special prime
+    const auto &coeff_modulus =
+        context_->get_context_data(encrypted.parms_id())->parms().coeff_modulus();
+    auto coeff_mod_count = coeff_modulus.size();
     auto coeff_count = params_.poly_modulus_degree();
     auto encrypted_count = encrypted.size();
 
-    //cout << "coeff mod count for power of X = " << coeff_mod_count << endl; 
-    //cout << "coeff count for power of X = " << coeff_count << endl; 
-
-    // First copy over.
-    destination = encrypted;
+    // Every coefficient is written below, so only the shape is copied over
+    destination.resize(context_, encrypted.parms_id(), encrypted_count);
+    destination.is_ntt_form() = encrypted.is_ntt_form();
 
-    // Prepare for destination
     // Multiply X^index for each ciphertext polynomial
     for (int i = 0; i < encrypted_count; i++) {
         for (int j = 0; j < coeff_mod_count; j++) {
             negacyclic_shift_poly_coeffmod(encrypted.data(i) + (j * coeff_count),
                                            coeff_count, index,
-                                           params_.coeff_modulus()[j],
+                                           coeff_modulus[j],
                                            destination.data(i) + (j * coeff_count));
         }
     }
 }
 
-inline void PIRServer::decompose_to_plaintexts_ptr(const Ciphertext &encrypted, Plaintext *plain_ptr, int logt) {
+void PIRServer::decompose_to_plaintexts_ptr(const Ciphertext &encrypted, Plaintext *plain_ptr, int logt) {
 
-    vector<Plaintext> result;
     auto coeff_count = params_.poly_modulus_degree();
-    auto coeff_mod_count = params_.coeff_modulus().size();
+    // The moduli of the ciphertext's own level, which has fewer of them than
+    // coeff_modulus (and fewer still once a reply is switched down)
+    const auto &coeff_modulus =
+        context_->get_context_data(encrypted.parms_id())->parms().coeff_modulus();
+    auto coeff_mod_count = coeff_modulus.size();
     auto encrypted_count = encrypted.size();
 
-    uint64_t t1 = 1 << logt;  //  t1 <= t. 
+    uint64_t t1 = uint64_t(1) << logt;  //  t1 <= t. 
 
     uint64_t t1minusone =  t1 -1; 
     // A triple for loop. Going over polys, moduli, and decomposed index.
@@ -392,17 +1330,15 @@ inline void PIRServer::decompose_to_plaintexts_ptr(const Ciphertext &encrypted,
             // create a polynomial to store the current decomposition value
             // which will be copied into the array to populate it at the current
             // index.
-            double logqj = log2(params_.coeff_modulus()[j].value());
-            //int expansion_ratio = ceil(logqj + exponent - 1) / exponent;
+            double logqj = log2(coeff_modulus[j].value());
             int expansion_ratio =  ceil(logqj / logt); 
-            // cout << "local expansion ratio = " << expansion_ratio << endl;
             uint64_t curexp = 0;
             for (int k = 0; k < expansion_ratio; k++) {
-                // Decompose here
+                // Decompose here; the moduli may need different numbers of
+                // digits, so the plaintexts are filled in order
+                Plaintext &plain = *plain_ptr++;
                 for (int m = 0; m < coeff_count; m++) {
-                    plain_ptr[i * coeff_mod_count * expansion_ratio
-                        + j * expansion_ratio + k][m] =
-                        (*(encrypted_pointer + m + (j * coeff_count)) >> curexp) & t1minusone;
+                    plain[m] = (*(encrypted_pointer + m + (j * coeff_count)) >> curexp) & t1minusone;
                 }
                 curexp += logt;
             }
@@ -413,7 +1349,9 @@ inline void PIRServer::decompose_to_plaintexts_ptr(const Ciphertext &encrypted,
 vector<Plaintext> PIRServer::decompose_to_plaintexts(const Ciphertext &encrypted) {
     vector<Plaintext> result;
     auto coeff_count = params_.poly_modulus_degree();
-    auto coeff_mod_count = params_.coeff_modulus().size();
+    const auto &coeff_modulus =
+        context_->get_context_data(encrypted.parms_id())->parms().coeff_modulus();
+    auto coeff_mod_count = coeff_modulus.size();
     auto plain_bit_count = params_.plain_modulus().bit_count();
     auto encrypted_count = encrypted.size();
 
@@ -428,7 +1366,7 @@ vector<Plaintext> PIRServer::decompose_to_plaintexts(const Ciphertext &encrypted
             // create a polynomial to store the current decomposition value
             // which will be copied into the array to populate it at the current
             // index.
-            int logqj = log2(params_.coeff_modulus()[j].value());
+            int logqj = log2(coeff_modulus[j].value());
             int expansion_ratio = ceil(logqj / log2(plainMod));
 
             // cout << "expansion ratio = " << expansion_ratio << endl;
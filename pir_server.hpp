@@ -1,11 +1,22 @@
 #pragma once
 
+#include "galois_key_store.hpp"
 #include "pir.hpp"
+#include "pir_trace.hpp"
+#include "thread_pool.hpp"
+#include <functional>
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <vector>
 #include "pir_client.hpp"
 
+// generate_reply, generate_replies and expand_query can be called from several
+// threads at once, sharing the database, the Galois keys and the thread pool.
+// Setting the database or the number of threads must not overlap with them.
 class PIRServer {
   public:
     PIRServer(const seal::EncryptionParameters &params, const PirParams &pir_params);
@@ -14,26 +25,188 @@ class PIRServer {
     // Caller cannot free db
     void set_database(std::unique_ptr<std::vector<seal::Plaintext>> &&db);
     void set_database(const std::unique_ptr<const std::uint8_t[]> &bytes, std::uint64_t ele_num, std::uint64_t ele_size);
+
+    // Streaming ingestion: read_chunk(buffer, size) must fill buffer with the
+    // next size bytes of the ele_num * ele_size byte database. Records are
+    // pulled one plaintext's worth at a time and encoded straight into NTT form,
+    // so peak memory stays close to the size of the preprocessed database and
+    // no call to preprocess_database is needed.
+    void set_database(const std::function<void(std::uint8_t *, std::uint64_t)> &read_chunk,
+                      std::uint64_t ele_num, std::uint64_t ele_size);
+    // Same as above, reading the records from a file descriptor
+    void set_database(int fd, std::uint64_t ele_num, std::uint64_t ele_size);
     void preprocess_database();
 
+    // Overwrites the given elements of a database set from bytes: bytes holds
+    // indices.size() elements of ele_size bytes, in the order of indices. Only
+    // the plaintexts holding those elements are re-encoded (and transformed to
+    // NTT if the database is preprocessed), so the cost does not depend on the
+    // database size.
+    void update_elements(const std::vector<std::uint64_t> &indices, const std::uint8_t *bytes);
+
+    // Writes the preprocessed (NTT form) database to a versioned file, so a
+    // restarted server can skip encoding and preprocessing via load_database.
+    void save_database(const std::string &path);
+    // Maps a file written by save_database read-only and serves queries from
+    // the mapping without copying it. Processes mapping the same file share
+    // one copy in the page cache. Replaces any database set before.
+    void load_database(const std::string &path);
+
+    // Keeps the database packed at plain_modulus().bit_count() bits per
+    // coefficient instead of in NTT form under every modulus, which is several
+    // times smaller. Replies then transform small blocks of plaintexts to NTT
+    // right before multiplying them, trading NTT work for memory and bandwidth.
+    // A database that is already set is converted in place.
+    void set_compact_storage(bool compact);
+
     std::vector<seal::Ciphertext> expand_query(
             const seal::Ciphertext &encrypted, std::uint32_t m, uint32_t client_id);
 
-    PirReply generate_reply(PirQuery query, std::uint32_t client_id);
+    PirReply generate_reply(const PirQuery &query, std::uint32_t client_id);
+
+    // Same as above, writing into reply and reusing its ciphertexts. Once the
+    // server's workspaces are warmed up, this path does no heap allocation.
+    // At most max_threads threads of the pool work on the reply (0 means all).
+    void generate_reply(const PirQuery &query, std::uint32_t client_id, PirReply &reply,
+                        std::uint32_t max_threads = 0);
+
+    // Answers a batch of queries with a single pass over the database: each
+    // database plaintext is multiplied with the expanded queries of the whole
+    // batch while it is in cache. queries[i] comes from client client_ids[i].
+    std::vector<PirReply> generate_replies(const std::vector<PirQuery> &queries,
+                                           const std::vector<std::uint32_t> &client_ids);
+
+    // Sharding (see pir_shard.hpp). A shard server holds rows [first_row,
+    // first_row + nvec[0]) of a first dimension of total_rows rows, with the
+    // other dimensions of the whole database. It expands its rows out of the
+    // first-dimension ctxts of a query and returns the first-dimension results
+    // over its rows; summed over the shards, they are those of the whole
+    // database. They stay at the query's level even with mod_switch, so that
+    // finish_reply switches the sum once.
+    void generate_partial_reply(const std::vector<seal::Ciphertext> &query,
+                                std::uint64_t first_row, std::uint64_t total_rows,
+                                std::uint32_t client_id, std::vector<seal::Ciphertext> &partial);
+
+    // Runs the dimensions after the first on the summed first-dimension
+    // results of a query. Needs no database.
+    void finish_reply(const PirQuery &query, std::uint32_t client_id,
+                      const std::vector<seal::Ciphertext> &intermediate, PirReply &reply);
 
     void set_galois_key(std::uint32_t client_id, seal::GaloisKeys galkey);
 
+    // Wire-format counterparts (see pir.hpp) of the query and keys a client
+    // sends; seeded ciphertexts and keys are expanded here
+    void set_galois_key(std::uint32_t client_id, std::string_view message);
+    PirQuery deserialize_query(std::string_view message) const;
+
+    // Replaces the store holding the clients' Galois keys, e.g. with one that
+    // has a memory budget and a spill directory, or one shared by several
+    // servers. Keys already set on the old store are not carried over.
+    void set_galois_key_store(std::shared_ptr<GaloisKeyStore> store);
+    const std::shared_ptr<GaloisKeyStore> &galois_key_store() const { return galois_keys_; }
+
+    // Number of threads used by generate_reply (1 keeps everything on the caller's thread)
+    void set_num_threads(std::uint32_t num_threads);
+
+    // Called after every generate_reply or generate_replies call with the time
+    // spent in each phase and the number of homomorphic operations. Without an
+    // observer no timings are taken. Must not be changed while replies run.
+    void set_reply_observer(std::function<void(const ReplyStats &)> observer);
+
+    // Bytes allocated so far for the reply workspaces (memory pools and buffer
+    // vectors). It stops growing once the workspaces are warm; main checks
+    // that a second reply leaves it unchanged.
+    std::size_t workspace_bytes() const;
+
   private:
+    // Buffers for one reply computation, sized from PirParams and kept for the
+    // next one. Every SEAL object in it allocates from its own pool.
+    struct Workspace {
+        seal::MemoryPoolHandle pool;
+        std::vector<std::vector<seal::Ciphertext>> expanded;     // per query of a batch
+        std::vector<std::vector<seal::Ciphertext>> intermediate; // per query of a batch
+        std::vector<seal::Plaintext> intermediate_plain;
+        std::vector<std::vector<seal::Ciphertext>> scratch;      // per thread
+        std::vector<const std::uint64_t *> plains;
+        std::vector<const seal::Ciphertext *> encrypted;
+        std::vector<std::vector<const std::uint64_t *>> column;  // per thread
+        std::vector<std::vector<seal::Ciphertext *>> destination; // per thread
+        std::vector<std::vector<std::uint64_t>> ntt_block;       // per thread, compact storage
+        std::vector<std::vector<const seal::Ciphertext *>> encrypted_block; // per thread
+        std::atomic<std::size_t> vector_bytes;                   // held by the vectors above
+        std::uint32_t threads;                                   // thread budget of the call
+        ReplyStats stats;
+    };
+
+    // Hands a workspace back to the free list when it goes out of scope
+    struct WorkspaceLease {
+        PIRServer &server;
+        Workspace *ws;
+        ~WorkspaceLease() { server.release_workspace(ws); }
+    };
+
     std::shared_ptr<seal::SEALContext> context_;
     seal::EncryptionParameters params_; // SEAL parameters
     PirParams pir_params_;              // PIR parameters
     std::unique_ptr<Database> db_;
     bool is_db_preprocessed_;
-    std::map<int, seal::GaloisKeys> galoisKeys_;
+    std::uint64_t ele_num_;  // element layout of a database set from bytes,
+    std::uint64_t ele_size_; // zero when the plaintexts were given directly
+    std::shared_ptr<const std::uint8_t> db_mapping_; // file mapped by load_database
+    std::uint64_t db_mapping_offset_;                // start of the plaintexts in it
+    bool compact_db_;
+    std::vector<std::uint64_t> db_packed_; // database in compact storage
+    std::shared_ptr<GaloisKeyStore> galois_keys_;
+    std::mutex preprocess_mutex_;
     std::unique_ptr<seal::Evaluator> evaluator_;
+    std::unique_ptr<ThreadPool> workers_;
+    std::function<void(const ReplyStats &)> reply_observer_;
+    std::vector<std::uint32_t> galois_elts_; // one per level of the expansion tree
+    std::vector<std::unique_ptr<Workspace>> workspaces_;
+    std::vector<Workspace *> free_workspaces_;
+    mutable std::mutex workspace_mutex_;
+
+    void encode_database(const std::function<void(std::uint8_t *, std::uint64_t)> &read_chunk,
+                         std::uint64_t ele_num, std::uint64_t ele_size, bool ntt);
+    Workspace *acquire_workspace();
+    void release_workspace(Workspace *ws);
+    void prepare_workspace(Workspace &ws, std::size_t batch);
+    void reply_batch(const PirQuery *const *queries, const std::uint32_t *client_ids,
+                     std::size_t batch, PirReply *const *replies, std::uint32_t max_threads);
+    std::shared_ptr<const seal::GaloisKeys> galois_key(std::uint32_t client_id) const;
+    void expand_query(const seal::Ciphertext &encrypted, std::uint32_t m,
+                      const seal::GaloisKeys &galkey, seal::Ciphertext *destination, Workspace &ws,
+                      bool ntt_output);
+    void expand_dimension(const std::vector<seal::Ciphertext> &query, std::uint64_t n_i,
+                          std::uint32_t client_id, seal::Ciphertext *destination, Workspace &ws);
+    void expand_rows(const std::vector<seal::Ciphertext> &query, std::uint64_t total_rows,
+                     std::uint64_t first_row, std::uint64_t rows, std::uint32_t client_id,
+                     seal::Ciphertext *destination, Workspace &ws);
+    void reply_remaining_dimensions(Workspace &ws, const PirQuery &query,
+                                    std::uint32_t client_id, std::size_t b,
+                                    std::uint64_t columns, PirReply &reply, Stopwatch &watch);
+    void multiply_dimension(Workspace &ws, std::size_t batch, std::size_t first_output,
+                            std::uint64_t n_i, std::uint64_t columns);
+    void transform_intermediate_from_ntt(Workspace &ws, std::size_t batch,
+                                         std::size_t first_output, std::uint64_t columns,
+                                         bool mod_switch);
+    void mod_switch_intermediate(Workspace &ws, std::size_t batch, std::size_t first_output,
+                                 std::uint64_t columns);
+    void multiply_compact_dimension(Workspace &ws, std::size_t batch, std::uint64_t n_i,
+                                    std::uint64_t columns);
+    void database_pointers(Workspace &ws);
+    std::uint64_t packed_words() const;
+    std::uint64_t compact_block_terms() const;
+    void pack_database();
+    void unpack_database();
+    void unpack_to_ntt(const std::uint64_t *packed, std::uint64_t *destination) const;
+    void decompose_to_ntt_plaintexts(Workspace &ws, const seal::Ciphertext *encrypted,
+                                     std::uint64_t count);
 
     void decompose_to_plaintexts_ptr(const seal::Ciphertext &encrypted, seal::Plaintext *plain_ptr, int logt);
     std::vector<seal::Plaintext> decompose_to_plaintexts(const seal::Ciphertext &encrypted);
     void multiply_power_of_X(const seal::Ciphertext &encrypted, seal::Ciphertext &destination,
                              std::uint32_t index);
+
+    friend class PIRBenchmark;
 };
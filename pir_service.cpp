@@ -0,0 +1,109 @@
+#include "pir_service.hpp"
+#include <algorithm>
+
+using namespace std;
+
+PIRService::PIRService(shared_ptr<PIRServer> server, const PIRServiceConfig &config) :
+    server_(move(server)),
+    config_(config),
+    stats_(),
+    stop_(false)
+{
+    if (!server_) {
+        throw invalid_argument("server cannot be null");
+    }
+    config_.num_threads = max<uint32_t>(1, config_.num_threads);
+    server_->set_num_threads(config_.num_threads);
+
+    for (uint32_t i = 0; i < config_.num_threads; i++) {
+        dispatchers_.emplace_back([this] { dispatcher_loop(); });
+    }
+}
+
+PIRService::~PIRService() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &dispatcher : dispatchers_) {
+        dispatcher.join();
+    }
+}
+
+future<PirReply> PIRService::submit(PirQuery query, uint32_t client_id) {
+    Request request;
+    request.query = move(query);
+    request.client_id = client_id;
+    request.arrival = chrono::steady_clock::now();
+    future<PirReply> reply = request.reply.get_future();
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (stop_) {
+            throw logic_error("service is shutting down");
+        }
+        if (queue_.size() >= config_.max_queue) {
+            stats_.rejected++;
+            throw PIRServiceOverloaded("request queue is full");
+        }
+        queue_.push_back(move(request));
+        stats_.submitted++;
+    }
+    cv_.notify_one();
+    return reply;
+}
+
+PIRServiceStats PIRService::stats() const {
+    lock_guard<mutex> lock(mutex_);
+    PIRServiceStats result = stats_;
+    result.queued = queue_.size();
+    return result;
+}
+
+void PIRService::dispatcher_loop() {
+    while (true) {
+        Request request;
+        uint32_t threads = 1;
+        bool expired;
+        {
+            unique_lock<mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            request = move(queue_.front());
+            queue_.pop_front();
+
+            auto waited = chrono::steady_clock::now() - request.arrival;
+            expired = config_.max_queue_delay.count() > 0 && waited > config_.max_queue_delay;
+            if (expired) {
+                stats_.expired++;
+            } else {
+                // Split the cores evenly among this query, the ones being
+                // answered and the ones still waiting for a dispatcher
+                uint64_t demand = stats_.in_flight + 1 + queue_.size();
+                threads = static_cast<uint32_t>(max<uint64_t>(1, config_.num_threads / demand));
+                stats_.in_flight++;
+            }
+        }
+
+        if (expired) {
+            request.reply.set_exception(make_exception_ptr(
+                PIRServiceOverloaded("request waited too long in the queue")));
+            continue;
+        }
+
+        try {
+            PirReply reply;
+            server_->generate_reply(request.query, request.client_id, reply, threads);
+            request.reply.set_value(move(reply));
+        } catch (...) {
+            request.reply.set_exception(current_exception());
+        }
+
+        lock_guard<mutex> lock(mutex_);
+        stats_.in_flight--;
+        stats_.completed++;
+    }
+}
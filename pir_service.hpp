@@ -0,0 +1,82 @@
+#pragma once
+
+#include "pir.hpp"
+#include "pir_server.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct PIRServiceConfig {
+    std::uint32_t num_threads;                 // cores the service may use
+    std::size_t max_queue;                     // waiting requests beyond which submit rejects
+    std::chrono::milliseconds max_queue_delay; // waiting time after which a request is dropped (0: none)
+};
+
+struct PIRServiceStats {
+    std::uint64_t submitted;
+    std::uint64_t completed;
+    std::uint64_t rejected; // turned away because the queue was full
+    std::uint64_t expired;  // dropped after waiting longer than max_queue_delay
+    std::size_t queued;
+    std::size_t in_flight;
+};
+
+// Thrown by submit, or stored in the returned future, when a request is shed
+class PIRServiceOverloaded : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+// Concurrent front end of a PIRServer. Queries from any number of threads are
+// queued and answered by num_threads dispatchers, which share the server's
+// thread pool. Each query gets an equal share of the cores among the queries
+// in flight and waiting: a lone query uses all of them, and under load every
+// query runs on one core, which maximizes throughput. The queue is bounded and
+// stale requests are dropped, so latency stays bounded when the offered load
+// exceeds capacity instead of growing with the backlog.
+class PIRService {
+  public:
+    // Sets the server's thread count to config.num_threads. The database and
+    // keys must be set on the server before queries are submitted; Galois keys
+    // of new clients can still be added while the service runs.
+    PIRService(std::shared_ptr<PIRServer> server, const PIRServiceConfig &config);
+
+    // Answers the requests still queued, then stops the dispatchers
+    ~PIRService();
+
+    PIRService(const PIRService &) = delete;
+    PIRService &operator=(const PIRService &) = delete;
+
+    // Queues a query. Throws PIRServiceOverloaded when the queue is full; the
+    // future holds the reply, or the exception that prevented it.
+    std::future<PirReply> submit(PirQuery query, std::uint32_t client_id);
+
+    PIRServiceStats stats() const;
+
+  private:
+    struct Request {
+        PirQuery query;
+        std::uint32_t client_id;
+        std::promise<PirReply> reply;
+        std::chrono::steady_clock::time_point arrival;
+    };
+
+    std::shared_ptr<PIRServer> server_;
+    PIRServiceConfig config_;
+    std::deque<Request> queue_;
+    PIRServiceStats stats_;
+    bool stop_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::thread> dispatchers_;
+
+    void dispatcher_loop();
+};
@@ -0,0 +1,322 @@
+#include "pir_shard.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace seal;
+
+namespace {
+
+enum class ShardRequest : uint8_t { galois_keys = 1, partial_reply = 2 };
+enum class ShardStatus : uint8_t { ok = 0, error = 1 };
+
+void write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw runtime_error(string("shard connection failed: ") + strerror(errno));
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+// Returns false if the connection was closed before the first byte
+bool read_all(int fd, char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 && done == 0) {
+            return false;
+        }
+        if (n <= 0) {
+            throw runtime_error("shard connection closed mid-message");
+        }
+        done += n;
+    }
+    return true;
+}
+
+uint32_t read_u32(const char *data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// A frame is a byte, then (for requests) the client id, then a u32 length and
+// the payload
+void write_frame(int fd, uint8_t type, const uint32_t *client_id, string_view payload) {
+    string header(1, static_cast<char>(type));
+    if (client_id) {
+        write_wire_u32(header, *client_id);
+    }
+    write_wire_u32(header, payload.size());
+    write_all(fd, header.data(), header.size());
+    write_all(fd, payload.data(), payload.size());
+}
+
+// Reads a shard's response to one request and returns its payload
+string read_response(int fd) {
+    char header[5];
+    if (!read_all(fd, header, sizeof(header))) {
+        throw runtime_error("shard closed the connection");
+    }
+    string payload(read_u32(header + 1), '\0');
+    if (!payload.empty() && !read_all(fd, payload.data(), payload.size())) {
+        throw runtime_error("shard connection closed mid-message");
+    }
+    if (static_cast<ShardStatus>(header[0]) != ShardStatus::ok) {
+        throw runtime_error("shard failed: " + payload);
+    }
+    return payload;
+}
+
+// Reads one response from every shard before rethrowing the first failure,
+// so that the connections stay in step
+vector<string> read_responses(const vector<int> &fds) {
+    vector<string> payloads(fds.size());
+    exception_ptr failure;
+    for (size_t s = 0; s < fds.size(); s++) {
+        try {
+            payloads[s] = read_response(fds[s]);
+        } catch (...) {
+            if (!failure) {
+                failure = current_exception();
+            }
+        }
+    }
+    if (failure) {
+        rethrow_exception(failure);
+    }
+    return payloads;
+}
+
+uint64_t product_after_first(const PirParams &pir_params) {
+    uint64_t columns = 1;
+    for (uint32_t i = 1; i < pir_params.nvec.size(); i++) {
+        columns *= pir_params.nvec[i];
+    }
+    return columns;
+}
+
+} // namespace
+
+pair<uint64_t, uint64_t> shard_rows(const PirParams &pir_params, uint32_t num_shards,
+                                    uint32_t shard) {
+    uint64_t rows = pir_params.nvec[0];
+    if (num_shards == 0 || shard >= num_shards || num_shards > rows) {
+        throw invalid_argument("every shard must hold at least one row");
+    }
+    // The first rows % num_shards shards take one row more
+    uint64_t base = rows / num_shards;
+    uint64_t extra = rows % num_shards;
+    uint64_t first = shard * base + min<uint64_t>(shard, extra);
+    return make_pair(first, base + (shard < extra ? 1 : 0));
+}
+
+PIRShardServer::PIRShardServer(const EncryptionParameters &params, const PirParams &pir_params,
+                               uint32_t num_shards, uint32_t shard) :
+    params_(params),
+    pir_params_(pir_params)
+{
+    auto rows = shard_rows(pir_params, num_shards, shard);
+    first_row_ = rows.first;
+    rows_ = rows.second;
+
+    // The shard is a server over a database of its rows only
+    PirParams shard_params = pir_params;
+    shard_params.nvec[0] = rows.second;
+    shard_params.n = rows.second * product_after_first(pir_params);
+    server_ = make_unique<PIRServer>(params, shard_params);
+    context_ = SEALContext::Create(params, true);
+}
+
+pair<uint64_t, uint64_t> PIRShardServer::element_range(uint64_t ele_num,
+                                                       uint64_t ele_size) const {
+    uint32_t logtp = floor(log2(params_.plain_modulus().value()));
+    uint64_t plains_per_row = product_after_first(pir_params_);
+    uint64_t ele_per_ptxt = elements_per_ptxt(logtp, params_.poly_modulus_degree(), ele_size);
+
+    // Row r holds plaintexts [r * plains_per_row, (r + 1) * plains_per_row)
+    uint64_t first = min(ele_num, first_row_ * plains_per_row * ele_per_ptxt);
+    uint64_t end = min(ele_num, (first_row_ + rows_) * plains_per_row * ele_per_ptxt);
+    return make_pair(first, end - first);
+}
+
+void PIRShardServer::set_database(const function<void(uint8_t *, uint64_t)> &read_chunk,
+                                  uint64_t ele_num, uint64_t ele_size) {
+    server_->set_database(read_chunk, element_range(ele_num, ele_size).second, ele_size);
+}
+
+void PIRShardServer::set_num_threads(uint32_t num_threads) {
+    server_->set_num_threads(num_threads);
+}
+
+void PIRShardServer::serve(int fd) {
+    uint64_t total_rows = pir_params_.nvec[0];
+    string message;
+    string response;
+    PirReply partial;
+
+    while (true) {
+        char header[9];
+        if (!read_all(fd, header, sizeof(header))) {
+            return;
+        }
+        auto type = static_cast<ShardRequest>(header[0]);
+        uint32_t client_id = read_u32(header + 1);
+        message.resize(read_u32(header + 5));
+        if (!message.empty() && !read_all(fd, message.data(), message.size())) {
+            throw runtime_error("coordinator connection closed mid-message");
+        }
+
+        // Failures of a request are sent back; only a broken connection ends
+        // the loop
+        response.clear();
+        ShardStatus status = ShardStatus::ok;
+        try {
+            if (type == ShardRequest::galois_keys) {
+                server_->set_galois_key(client_id, message);
+            } else if (type == ShardRequest::partial_reply) {
+                PirQuery query = deserialize_query_message(context_, message);
+                if (query.size() != 1) {
+                    throw invalid_argument("expected the first dimension of a query");
+                }
+                server_->generate_partial_reply(query[0], first_row_, total_rows, client_id,
+                                                partial);
+                serialize_reply_message(partial, response);
+            } else {
+                throw invalid_argument("unknown shard request");
+            }
+        } catch (const exception &e) {
+            status = ShardStatus::error;
+            response = e.what();
+        }
+        write_frame(fd, static_cast<uint8_t>(status), nullptr, response);
+    }
+}
+
+PIRShardCoordinator::PIRShardCoordinator(const EncryptionParameters &params,
+                                         const PirParams &pir_params, vector<int> shard_fds) :
+    context_(SEALContext::Create(params, true)),
+    evaluator_(make_unique<Evaluator>(context_)),
+    server_(make_unique<PIRServer>(params, pir_params)),
+    shard_fds_(move(shard_fds))
+{
+    // Fails early if there are more shards than rows
+    shard_rows(pir_params, shard_fds_.size(), 0);
+}
+
+PIRShardCoordinator::~PIRShardCoordinator() {
+    for (int fd : shard_fds_) {
+        close(fd);
+    }
+}
+
+void PIRShardCoordinator::set_galois_key(uint32_t client_id, const GaloisKeys &galkey) {
+    string message = serialize_galoiskeys_message(galkey);
+
+    lock_guard<mutex> lock(mutex_);
+    for (int fd : shard_fds_) {
+        write_frame(fd, static_cast<uint8_t>(ShardRequest::galois_keys), &client_id, message);
+    }
+    read_responses(shard_fds_);
+    server_->set_galois_key(client_id, galkey);
+}
+
+void PIRShardCoordinator::set_num_threads(uint32_t num_threads) {
+    server_->set_num_threads(num_threads);
+}
+
+PirReply PIRShardCoordinator::generate_reply(const PirQuery &query, uint32_t client_id) {
+    if (query.empty()) {
+        throw invalid_argument("query does not match the number of dimensions");
+    }
+
+    // A query message holding only the first dimension
+    string message;
+    write_wire_header(message, WireKind::query);
+    write_wire_u32(message, 1);
+    write_wire_u32(message, query[0].size());
+    for (const auto &ciphertext : query[0]) {
+        write_wire_object(message, ciphertext);
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    // Every shard gets the query before any result is read, so they all work
+    // at once
+    for (int fd : shard_fds_) {
+        write_frame(fd, static_cast<uint8_t>(ShardRequest::partial_reply), &client_id, message);
+    }
+    vector<string> partials = read_responses(shard_fds_);
+
+    vector<Ciphertext> intermediate = deserialize_reply_message(context_, partials[0]);
+    for (size_t s = 1; s < partials.size(); s++) {
+        PirReply partial = deserialize_reply_message(context_, partials[s]);
+        if (partial.size() != intermediate.size()) {
+            throw runtime_error("shards returned results of different sizes");
+        }
+        for (size_t k = 0; k < partial.size(); k++) {
+            evaluator_->add_inplace(intermediate[k], partial[k]);
+        }
+    }
+
+    PirReply reply;
+    server_->finish_reply(query, client_id, intermediate, reply);
+    return reply;
+}
+
+int listen_unix_socket(const string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw invalid_argument("socket path is too long");
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw runtime_error(string("socket failed: ") + strerror(errno));
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        int error = errno;
+        close(fd);
+        throw runtime_error("cannot listen on " + path + ": " + strerror(error));
+    }
+    return fd;
+}
+
+int connect_unix_socket(const string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw invalid_argument("socket path is too long");
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw runtime_error(string("socket failed: ") + strerror(errno));
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        int error = errno;
+        close(fd);
+        throw runtime_error("cannot connect to " + path + ": " + strerror(error));
+    }
+    return fd;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "pir.hpp"
+#include "pir_server.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A database sharded by rows of its first dimension. Each shard process holds
+// the plaintexts of its rows only, and answers the first dimension of a query
+// over them. A coordinator sends the first-dimension ctxts of every query to
+// all shards, adds up their results and runs the remaining dimensions itself,
+// which only touch the small intermediate results. The reply is the same as
+// that of one server holding the whole database.
+//
+// Shards and coordinator talk over stream sockets (Unix or TCP). A request is
+// a byte for its kind, the client id and the length of a wire message (see
+// pir.hpp), then the message; a response is a status byte, the length and
+// either a reply message or an error string. Integers are little endian u32.
+
+// Rows [first, first + count) of the first dimension held by a shard; the
+// rows are split as evenly as possible
+std::pair<std::uint64_t, std::uint64_t> shard_rows(const PirParams &pir_params,
+                                                   std::uint32_t num_shards,
+                                                   std::uint32_t shard);
+
+class PIRShardServer {
+  public:
+    // pir_params describe the whole database
+    PIRShardServer(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                   std::uint32_t num_shards, std::uint32_t shard);
+
+    // Elements [first, first + count) of a database of ele_num elements of
+    // ele_size bytes that fall in this shard's rows
+    std::pair<std::uint64_t, std::uint64_t> element_range(std::uint64_t ele_num,
+                                                          std::uint64_t ele_size) const;
+
+    // read_chunk reads the shard's elements (see element_range) in order
+    void set_database(const std::function<void(std::uint8_t *, std::uint64_t)> &read_chunk,
+                      std::uint64_t ele_num, std::uint64_t ele_size);
+
+    void set_num_threads(std::uint32_t num_threads);
+
+    // Answers the requests of one coordinator connection until it is closed
+    void serve(int fd);
+
+  private:
+    seal::EncryptionParameters params_;
+    PirParams pir_params_; // of the whole database
+    std::shared_ptr<seal::SEALContext> context_;
+    std::uint64_t first_row_; // rows [first_row_, first_row_ + rows_) are held
+    std::uint64_t rows_;
+    std::unique_ptr<PIRServer> server_;
+};
+
+class PIRShardCoordinator {
+  public:
+    // shard_fds are connected sockets, one per shard in shard order. The
+    // coordinator takes them over and closes them.
+    PIRShardCoordinator(const seal::EncryptionParameters &params, const PirParams &pir_params,
+                        std::vector<int> shard_fds);
+    ~PIRShardCoordinator();
+
+    PIRShardCoordinator(const PIRShardCoordinator &) = delete;
+    PIRShardCoordinator &operator=(const PIRShardCoordinator &) = delete;
+
+    // Registers the keys with every shard and with the coordinator
+    void set_galois_key(std::uint32_t client_id, const seal::GaloisKeys &galkey);
+
+    void set_num_threads(std::uint32_t num_threads);
+
+    // Shards work on the query side by side; queries are sent one at a time.
+    // Throws runtime_error if a shard fails or the connection breaks.
+    PirReply generate_reply(const PirQuery &query, std::uint32_t client_id);
+
+  private:
+    std::shared_ptr<seal::SEALContext> context_;
+    std::unique_ptr<seal::Evaluator> evaluator_;
+    std::unique_ptr<PIRServer> server_;
+    std::vector<int> shard_fds_;
+    std::mutex mutex_; // one request on the connections at a time
+};
+
+// Sockets for running shards on one machine. Both throw runtime_error.
+int listen_unix_socket(const std::string &path);
+int connect_unix_socket(const std::string &path);
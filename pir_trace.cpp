@@ -0,0 +1,26 @@
+#include "pir_trace.hpp"
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+namespace {
+
+mutex log_mutex;
+function<void(LogLevel, const string &)> log_sink;
+
+} // namespace
+
+void set_log_sink(function<void(LogLevel, const string &)> sink) {
+    lock_guard<mutex> lock(log_mutex);
+    log_sink = move(sink);
+}
+
+void log_message(LogLevel level, const string &message) {
+    lock_guard<mutex> lock(log_mutex);
+    if (log_sink) {
+        log_sink(level, message);
+    } else {
+        cout << message << endl;
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Log messages have a level; messages above SEALPIR_MAX_LOG_LEVEL are compiled
+// out, and set_log_level chooses among the rest at run time. Per-query
+// messages are at debug level, so the default (info) keeps the hot path quiet.
+enum class LogLevel { none = 0, info = 1, debug = 2 };
+
+#ifndef SEALPIR_MAX_LOG_LEVEL
+#define SEALPIR_MAX_LOG_LEVEL 2
+#endif
+
+inline std::atomic<int> log_level_value{static_cast<int>(LogLevel::info)};
+
+inline void set_log_level(LogLevel level) {
+    log_level_value.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+inline bool log_enabled(LogLevel level) {
+    return static_cast<int>(level) <= log_level_value.load(std::memory_order_relaxed);
+}
+
+// Lines go to cout unless a sink is set. Each message is passed on whole and
+// under a lock, so lines from concurrent queries do not interleave.
+void set_log_sink(std::function<void(LogLevel, const std::string &)> sink);
+void log_message(LogLevel level, const std::string &message);
+
+// The message is only formatted when its level is enabled
+#define PIR_LOG(level, message)                                                        \
+    do {                                                                               \
+        if (static_cast<int>(level) <= SEALPIR_MAX_LOG_LEVEL && log_enabled(level)) { \
+            std::ostringstream pir_log_stream;                                         \
+            pir_log_stream << message;                                                 \
+            log_message(level, pir_log_stream.str());                                  \
+        }                                                                              \
+    } while (0)
+
+// Time spent in each phase of one level (dimension) of a reply, summed over the
+// queries of the batch
+struct ReplyLevelStats {
+    std::chrono::nanoseconds decomposition; // of the previous level's result
+    std::chrono::nanoseconds expansion; // including the NTT of the expanded ctxts
+    std::chrono::nanoseconds inner_product;
+    std::chrono::nanoseconds inverse_ntt;
+};
+
+struct ReplyStats {
+    std::size_t queries;
+    std::chrono::nanoseconds total;
+    std::vector<ReplyLevelStats> levels;
+    std::uint64_t galois_applications;
+    std::uint64_t plain_multiplications;  // ciphertext-plaintext products
+    std::uint64_t ntt_transforms;         // forward, of ciphertexts and plaintexts
+    std::uint64_t inverse_ntt_transforms;
+};
+
+// Adds the time since the previous lap to a phase; does nothing when disabled
+class Stopwatch {
+  public:
+    explicit Stopwatch(bool enabled) : enabled_(enabled) {
+        if (enabled_) {
+            last_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    void lap(std::chrono::nanoseconds &phase) {
+        if (enabled_) {
+            auto now = std::chrono::steady_clock::now();
+            phase += now - last_;
+            last_ = now;
+        }
+    }
+
+  private:
+    bool enabled_;
+    std::chrono::steady_clock::time_point last_;
+};
@@ -0,0 +1,344 @@
+#include "pir_tuner.hpp"
+#include "demo_util.hpp"
+#include "pir_client.hpp"
+#include "pir_kernels.hpp"
+#include "pir_server.hpp"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+using namespace seal;
+
+namespace {
+
+// Plaintext modulus bits the tuner considers
+constexpr uint32_t min_logt = 12;
+constexpr uint32_t max_logt = 40;
+
+// Plaintext modulus bits the costs are calibrated at
+constexpr uint32_t calibration_logt = 20;
+
+// Terms of the inner product timed during calibration
+constexpr uint32_t calibration_terms = 32;
+
+// Cheapest predicted candidates tune checks for real before giving up
+constexpr uint32_t max_verifications = 8;
+
+double median_seconds(uint32_t reps, const function<void()> &fn) {
+    vector<double> times;
+    for (uint32_t r = 0; r < max<uint32_t>(reps, 1); r++) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// The encryption parameters gen_params makes for N and logt
+EncryptionParameters tuner_params(uint32_t N, uint32_t logt) {
+    EncryptionParameters params(scheme_type::BFV);
+    params.set_poly_modulus_degree(N);
+    params.set_coeff_modulus(CoeffModulus::BFVDefault(N));
+    params.set_plain_modulus(PlainModulus::Batching(N, logt));
+    return params;
+}
+
+// Sizes tried for all but the first dimension: every small size, then a
+// geometric grid with ratio 5/4 up to n
+vector<uint64_t> size_grid(uint64_t n) {
+    vector<uint64_t> sizes;
+    for (uint64_t s = 2; s < n; s = (s < 64) ? s + 1 : s + s / 4) {
+        sizes.push_back(s);
+    }
+    return sizes;
+}
+
+// Calls fn with every candidate shape of d dimensions covering n plaintexts.
+// suffix holds the sizes chosen so far, last dimension first; the first
+// dimension takes whatever is left.
+void for_each_shape(uint64_t n, uint32_t d, vector<uint64_t> &suffix,
+                    const function<void(const vector<uint64_t> &)> &fn) {
+    if (d == 1) {
+        vector<uint64_t> nvec(1, n);
+        nvec.insert(nvec.end(), suffix.rbegin(), suffix.rend());
+        fn(nvec);
+        return;
+    }
+    for (uint64_t s : size_grid(n)) {
+        suffix.push_back(s);
+        for_each_shape((n + s - 1) / s, d - 1, suffix, fn);
+        suffix.pop_back();
+    }
+}
+
+} // namespace
+
+PIRTuner::PIRTuner(vector<uint32_t> degrees) : degrees_(move(degrees)) {
+    if (degrees_.empty()) {
+        throw invalid_argument("no degrees to choose from");
+    }
+}
+
+const TunerCosts &PIRTuner::calibrate(uint32_t N, uint32_t reps) {
+    EncryptionParameters params = tuner_params(N, calibration_logt);
+    auto context = SEALContext::Create(params);
+    if (!context->parameters_set()) {
+        throw invalid_argument(context->parameter_error_message());
+    }
+
+    KeyGenerator keygen(context);
+    Encryptor encryptor(context, keygen.public_key());
+    Decryptor decryptor(context, keygen.secret_key());
+    Evaluator evaluator(context);
+    GaloisKeys galois_keys = keygen.galois_keys_local(vector<uint32_t>{N + 1});
+
+    uint64_t t = params.plain_modulus().value();
+    mt19937_64 gen(1);
+    auto random_plain = [&]() {
+        Plaintext plain(N);
+        for (uint32_t i = 0; i < N; i++) {
+            plain[i] = gen() % t;
+        }
+        return plain;
+    };
+
+    TunerCosts costs;
+    costs.N = N;
+    costs.logt = calibration_logt;
+
+    // A query ciphertext, as the client makes it
+    Plaintext selector(N);
+    selector[1] = 1;
+    Ciphertext query;
+    encryptor.encrypt(selector, query);
+    costs.ciphertext_bytes = query.save_size();
+    costs.fresh_noise_budget = decryptor.invariant_noise_budget(query);
+
+    Ciphertext expanded;
+    costs.galois = median_seconds(reps, [&] {
+        evaluator.apply_galois(query, N + 1, galois_keys, expanded);
+        evaluator.add_inplace(expanded, query);
+    });
+    costs.expansion_noise =
+        costs.fresh_noise_budget - decryptor.invariant_noise_budget(expanded);
+
+    Ciphertext expanded_ntt;
+    costs.ntt = median_seconds(reps, [&] { evaluator.transform_to_ntt(expanded, expanded_ntt); });
+
+    // Inner products are timed with the kernel the server uses
+    auto parms_id = expanded_ntt.parms_id();
+    const auto &coeff_modulus = context->get_context_data(parms_id)->parms().coeff_modulus();
+    vector<Plaintext> plains(calibration_terms);
+    vector<const uint64_t *> plain_ptrs(calibration_terms);
+    for (uint32_t j = 0; j < calibration_terms; j++) {
+        plains[j] = random_plain();
+        evaluator.transform_to_ntt_inplace(plains[j], parms_id);
+        plain_ptrs[j] = plains[j].data();
+    }
+    Ciphertext inner_product = expanded_ntt;
+    costs.plain_multiplication = median_seconds(reps, [&] {
+        dot_product_ntt(&expanded_ntt, plain_ptrs.data(), calibration_terms, coeff_modulus, N,
+                        inner_product);
+    }) / calibration_terms;
+
+    Ciphertext result;
+    costs.inverse_ntt = median_seconds(reps, [&] {
+        evaluator.transform_from_ntt(inner_product, result);
+    });
+
+    Ciphertext single;
+    evaluator.multiply_plain(expanded_ntt, plains[0], single);
+    evaluator.transform_from_ntt_inplace(single);
+    costs.multiplication_noise =
+        decryptor.invariant_noise_budget(expanded) - decryptor.invariant_noise_budget(single);
+
+    // A result switched down to the last level, as replies are with mod_switch
+    Ciphertext switched;
+    costs.mod_switch = median_seconds(reps, [&] {
+        evaluator.mod_switch_to(single, context->last_parms_id(), switched);
+    });
+    costs.mod_switch_noise =
+        decryptor.invariant_noise_budget(single) - decryptor.invariant_noise_budget(switched);
+
+    // The bit slicing of a decomposition is negligible next to the NTT
+    Plaintext decomposed = random_plain();
+    Plaintext decomposed_ntt;
+    costs.decomposition = median_seconds(reps, [&] {
+        evaluator.transform_to_ntt(decomposed, parms_id, decomposed_ntt);
+    });
+
+    PIR_LOG(LogLevel::debug, "Tuner: N = " << N << ": galois " << costs.galois
+            << " s, ntt " << costs.ntt << " s, inverse ntt " << costs.inverse_ntt
+            << " s, product " << costs.plain_multiplication << " s, decomposition "
+            << costs.decomposition << " s, mod switch " << costs.mod_switch << " s, noise "
+            << costs.fresh_noise_budget << "/" << costs.expansion_noise << "/"
+            << costs.multiplication_noise << "/" << costs.mod_switch_noise << " bits");
+
+    return costs_[N] = costs;
+}
+
+void PIRTuner::set_costs(const TunerCosts &costs) {
+    costs_[costs.N] = costs;
+}
+
+const TunerCosts &PIRTuner::costs(uint32_t N) {
+    auto it = costs_.find(N);
+    if (it != costs_.end()) {
+        return it->second;
+    }
+    return calibrate(N);
+}
+
+TunerChoice PIRTuner::predict(uint64_t ele_num, uint64_t ele_size, uint32_t N, uint32_t logt,
+                              const vector<uint64_t> &nvec, const TunerObjective &objective) {
+    const TunerCosts &c = costs(N);
+    uint64_t plaintext_num = plaintexts_per_db(logt - 1, N, ele_num, ele_size);
+    uint64_t product = 1;
+    for (auto n_i : nvec) {
+        if (n_i == 0) {
+            throw invalid_argument("dimensions must be nonzero");
+        }
+        product *= n_i;
+    }
+    if (nvec.empty() || product < plaintext_num) {
+        throw invalid_argument("dimensions do not cover the database");
+    }
+
+    // Replies are decomposed and sized at the moduli they are switched to
+    EncryptionParameters params = tuner_params(N, logt);
+    uint64_t ratio = compute_expansion_ratio(params, objective.mod_switch);
+    uint64_t reply_ctxt_bytes = c.ciphertext_bytes
+        * reply_coeff_modulus(params, objective.mod_switch).size()
+        / reply_coeff_modulus(params, false).size();
+
+    // Walks the levels of a reply like PIRServer::generate_reply, counting
+    // the operations of each phase
+    double seconds = 0;
+    uint64_t query_ctxts = 0;
+    int budget = INT_MAX;
+    uint64_t columns = product;
+    for (uint32_t i = 0; i < nvec.size(); i++) {
+        uint64_t n_i = nvec[i];
+        if (i > 0) {
+            columns *= ratio;
+            seconds += columns * c.decomposition;
+        }
+
+        uint64_t ctxts = (n_i + N - 1) / N;
+        query_ctxts += ctxts;
+        seconds += (n_i - ctxts) * c.galois + n_i * c.ntt;
+        seconds += columns * c.plain_multiplication;
+        columns /= n_i;
+        seconds += columns * c.inverse_ntt;
+        if (objective.mod_switch) {
+            seconds += columns * c.mod_switch;
+        }
+
+        // Each level is decrypted separately, so the worst one decides. A
+        // larger plaintext modulus costs a bit of budget up front and a bit
+        // in every product. Switching a result down costs its own share.
+        int levels = ceil(log2(min<uint64_t>(n_i, N)));
+        int level_budget = c.fresh_noise_budget - levels * c.expansion_noise
+            - c.multiplication_noise - static_cast<int>(ceil(log2(n_i)))
+            - 2 * (static_cast<int>(logt) - static_cast<int>(c.logt))
+            - (objective.mod_switch ? c.mod_switch_noise : 0);
+        budget = min(budget, level_budget);
+    }
+
+    TunerChoice choice;
+    choice.N = N;
+    choice.logt = logt;
+    choice.nvec = nvec;
+    choice.server_seconds = seconds;
+    choice.query_bytes = query_ctxts * c.ciphertext_bytes;
+    choice.reply_bytes = columns * reply_ctxt_bytes;
+    choice.noise_budget = budget;
+    choice.measured_noise_budget = 0;
+    choice.cost = objective.server_weight * seconds
+        + objective.byte_weight * (choice.query_bytes + choice.reply_bytes);
+    return choice;
+}
+
+TunerChoice PIRTuner::tune(uint64_t ele_num, uint64_t ele_size, const TunerObjective &objective) {
+    vector<TunerChoice> candidates;
+
+    for (uint32_t N : degrees_) {
+        costs(N);
+        for (uint32_t logt = min_logt; logt <= max_logt; logt++) {
+            // An element must fit in one plaintext, at logt - 1 bits per coefficient
+            if (coefficients_per_element(logt - 1, ele_size) > N) {
+                continue;
+            }
+            try {
+                PlainModulus::Batching(N, logt);
+            } catch (const exception &) {
+                continue;
+            }
+
+            uint64_t plaintext_num = plaintexts_per_db(logt - 1, N, ele_num, ele_size);
+            for (uint32_t d = 1; d <= objective.max_dimensions; d++) {
+                vector<uint64_t> suffix;
+                for_each_shape(plaintext_num, d, suffix, [&](const vector<uint64_t> &nvec) {
+                    TunerChoice choice = predict(ele_num, ele_size, N, logt, nvec, objective);
+                    if (choice.noise_budget >= objective.min_noise_budget) {
+                        candidates.push_back(choice);
+                    }
+                });
+            }
+        }
+    }
+
+    // The noise model is rough, so the cheapest candidates are run for real
+    // until one holds up
+    sort(candidates.begin(), candidates.end(),
+         [](const TunerChoice &a, const TunerChoice &b) { return a.cost < b.cost; });
+    for (uint32_t k = 0; k < candidates.size() && k < max_verifications; k++) {
+        TunerChoice &best = candidates[k];
+        if (!verify(ele_num, ele_size, best, objective)) {
+            PIR_LOG(LogLevel::info, "Tuner: N = " << best.N << ", logt = " << best.logt
+                    << ", d = " << best.nvec.size() << " fails: predicted "
+                    << best.noise_budget << " bits, measured " << best.measured_noise_budget);
+            continue;
+        }
+        PIR_LOG(LogLevel::debug, "Tuner: N = " << best.N << ", logt = " << best.logt << ", d = "
+                << best.nvec.size() << ", predicted " << best.server_seconds << " s and "
+                << best.query_bytes + best.reply_bytes << " bytes, "
+                << best.measured_noise_budget << " bits of noise budget left");
+        return best;
+    }
+    throw runtime_error("no parameters keep the required noise budget");
+}
+
+bool PIRTuner::verify(uint64_t ele_num, uint64_t ele_size, TunerChoice &choice,
+                      const TunerObjective &objective) {
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    gen_params(ele_num, ele_size, choice.N, choice.logt, choice.nvec, params, pir_params,
+               objective.mod_switch);
+
+    // Compact storage keeps a check of a large database within memory
+    PIRServer server(params, pir_params);
+    server.set_num_threads(max(1u, thread::hardware_concurrency()));
+    server.set_compact_storage(true);
+    uint64_t seed = 0x74756e6572ULL;
+    server.set_database(seeded_database(seed), ele_num, ele_size);
+
+    PIRClient client(params, pir_params);
+    server.set_galois_key(0, client.generate_galois_keys());
+
+    // The last element sits in the last plaintext, at the far end of every
+    // dimension
+    uint64_t ele_index = ele_num - 1;
+    uint64_t index = client.get_fv_index(ele_index, ele_size);
+    uint64_t offset = client.get_fv_offset(ele_index, ele_size);
+    PirReply reply = server.generate_reply(client.generate_query(index), 0);
+    Plaintext result = client.decode_reply(reply, index, choice.measured_noise_budget);
+    return check_seeded_element(params, result, seed, ele_index, offset, ele_size) &&
+           choice.measured_noise_budget >= objective.min_noise_budget;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "pir.hpp"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Calibrated costs of the operations a reply is made of, for one degree N.
+// Times are single-core seconds on the machine that ran the calibration.
+struct TunerCosts {
+    std::uint32_t N;
+    double galois;                   // one expansion step: automorphism and addition
+    double ntt;                      // forward NTT of an expanded query ciphertext
+    double inverse_ntt;              // inverse NTT of a result ciphertext
+    double plain_multiplication;     // one term of an NTT-domain inner product
+    double decomposition;            // one NTT plaintext made from a result ciphertext
+    double mod_switch;               // switch of a result ciphertext to the last level
+    std::uint64_t ciphertext_bytes;  // serialized size of a query or reply ciphertext
+    std::uint32_t logt;              // plaintext modulus bits the noise was measured at
+    int fresh_noise_budget;          // bits, of a fresh query ciphertext
+    int expansion_noise;             // bits consumed by one level of query expansion
+    int multiplication_noise;        // bits consumed by a product with a database plaintext
+    int mod_switch_noise;            // bits consumed by a switch to the last level
+};
+
+// What a configuration costs: server_weight per second of predicted server
+// time plus byte_weight per byte of query and reply. For the latency seen by a
+// client on a 100 Mbit/s link, use 1 and 8e-8 (seconds per byte).
+struct TunerObjective {
+    double server_weight;
+    double byte_weight;
+    int min_noise_budget;          // bits that must be left at decryption
+    std::uint32_t max_dimensions;  // largest d considered
+    bool mod_switch;               // whether replies are switched to the last level
+};
+
+// Parameters for a database, with their predicted costs
+struct TunerChoice {
+    std::uint32_t N;
+    std::uint32_t logt;
+    std::vector<std::uint64_t> nvec;
+    double server_seconds;         // single-core time of one reply
+    std::uint64_t query_bytes;
+    std::uint64_t reply_bytes;
+    int noise_budget;              // predicted bits left at decryption, at the worst level
+    int measured_noise_budget;     // bits left in one real reply, once tune checked it
+    double cost;
+};
+
+// Chooses N, logt and the dimensions of the database from a cost model of the
+// local machine. The model counts the operations of a reply exactly as the
+// server performs them (see ReplyStats) and prices each with costs measured by
+// short microbenchmarks; noise is tracked per dimension, since each dimension
+// of the reply is decrypted on its own. Dimensions need not be balanced: a
+// later dimension works on expansion_ratio times more ciphertexts than the one
+// before it, so the best shapes are usually larger in the first dimension.
+//
+//   PIRTuner tuner;
+//   TunerChoice choice = tuner.tune(ele_num, ele_size, objective);
+//   gen_params(ele_num, ele_size, choice.N, choice.logt, choice.nvec, params, pir_params,
+//              objective.mod_switch);
+class PIRTuner {
+  public:
+    // Candidate degrees; each is calibrated the first time it is needed
+    explicit PIRTuner(std::vector<std::uint32_t> degrees = {4096, 8192});
+
+    // Measures the costs for degree N, taking the median of reps runs of each
+    // operation, and keeps them for later predictions
+    const TunerCosts &calibrate(std::uint32_t N, std::uint32_t reps = 10);
+
+    // Uses costs measured elsewhere, e.g. on the server that will answer queries
+    void set_costs(const TunerCosts &costs);
+
+    // Predicted costs of the given parameters. The noise budget is negative
+    // when replies are not expected to decrypt.
+    TunerChoice predict(std::uint64_t ele_num, std::uint64_t ele_size, std::uint32_t N,
+                        std::uint32_t logt, const std::vector<std::uint64_t> &nvec,
+                        const TunerObjective &objective);
+
+    // The cheapest parameters that keep min_noise_budget. The prediction only
+    // shortlists them: the winner is checked with one real query, reply and
+    // decoding over a random database of the same shape, and the next
+    // cheapest candidate is tried if the result is wrong or the measured
+    // budget is short. Throws runtime_error when no candidate passes.
+    TunerChoice tune(std::uint64_t ele_num, std::uint64_t ele_size,
+                     const TunerObjective &objective);
+
+    // Runs that check for choice, setting its measured_noise_budget. True if
+    // the element came back intact with min_noise_budget bits to spare.
+    bool verify(std::uint64_t ele_num, std::uint64_t ele_size, TunerChoice &choice,
+                const TunerObjective &objective);
+
+  private:
+    std::vector<std::uint32_t> degrees_;
+    std::map<std::uint32_t, TunerCosts> costs_;
+
+    const TunerCosts &costs(std::uint32_t N);
+};
@@ -0,0 +1,88 @@
+#include "demo_util.hpp"
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_server.hpp"
+#include "pir_service.hpp"
+#include <seal/seal.h>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+using namespace std;
+using namespace seal;
+
+// Runs a service with one dispatcher and a 1 ms queueing limit: a query that
+// is being answered completes, and the ones queued behind it expire.
+int main(int argc, char *argv[]) {
+
+    uint64_t number_of_items = 1 << 12;
+    uint64_t size_per_item = 288; // in bytes
+    uint32_t N = 4096;
+    uint32_t logt = 20;
+    uint32_t d = 2;
+    uint32_t queued_queries = 3;
+
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    gen_params(number_of_items, size_per_item, N, logt, d, params, pir_params);
+
+    random_device rd;
+    uint64_t db_seed = random_seed();
+    auto server = make_shared<PIRServer>(params, pir_params);
+    server->set_database(seeded_database(db_seed), number_of_items, size_per_item);
+
+    PIRClient client(params, pir_params);
+    server->set_galois_key(0, client.generate_galois_keys());
+
+    uint64_t ele_index = rd() % number_of_items;
+    uint64_t index = client.get_fv_index(ele_index, size_per_item);
+    uint64_t offset = client.get_fv_offset(ele_index, size_per_item);
+    PirQuery query = client.generate_query(index);
+
+    int status = 0;
+    {
+        PIRService service(server, PIRServiceConfig{1, 8, milliseconds(1)});
+
+        // The later queries are submitted once the dispatcher is busy with
+        // the first, so they wait for much longer than the limit
+        future<PirReply> first = service.submit(query, 0);
+        while (service.stats().in_flight == 0 && service.stats().completed == 0) {
+            this_thread::sleep_for(microseconds(100));
+        }
+        vector<future<PirReply>> later;
+        for (uint32_t i = 0; i < queued_queries; i++) {
+            later.push_back(service.submit(query, 0));
+        }
+
+        Plaintext result = client.decode_reply(first.get(), index);
+        if (!check_seeded_element(params, result, db_seed, ele_index, offset, size_per_item)) {
+            status = -1;
+        }
+        cout << (status == 0 ? "Service: answered query correct"
+                             : "Service: answered query wrong!") << endl;
+
+        uint32_t expired = 0;
+        for (auto &reply : later) {
+            try {
+                reply.get();
+            } catch (const PIRServiceOverloaded &) {
+                expired++;
+            }
+        }
+        PIRServiceStats stats = service.stats();
+        if (expired != queued_queries || stats.expired != queued_queries ||
+            stats.completed != 1) {
+            cout << "Service: " << expired << " of " << queued_queries
+                 << " queued queries expired, " << stats.completed << " completed" << endl;
+            status = -1;
+        } else {
+            cout << "Service: all " << queued_queries << " queued queries expired" << endl;
+        }
+    }
+    return status;
+}
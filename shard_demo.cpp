@@ -0,0 +1,108 @@
+#include "demo_util.hpp"
+#include "pir.hpp"
+#include "pir_client.hpp"
+#include "pir_shard.hpp"
+#include <seal/seal.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+using namespace std;
+using namespace seal;
+
+// Runs a sharded database on one machine: every shard is a child process
+// serving its rows over a Unix socket, and this process is the coordinator
+// and the client.
+int main(int argc, char *argv[]) {
+
+    uint32_t num_shards = (argc > 1) ? stoul(argv[1]) : 3;
+    uint64_t number_of_items = 1 << 12;
+    uint64_t size_per_item = 288; // in bytes
+    uint32_t N = 4096;
+    uint32_t logt = 20;
+    uint32_t d = 2;
+
+    EncryptionParameters params(scheme_type::BFV);
+    PirParams pir_params;
+    gen_params(number_of_items, size_per_item, N, logt, d, params, pir_params, true);
+    cout << "Shard: " << num_shards << " shards over " << pir_params.nvec[0]
+         << " rows of the first dimension" << endl;
+
+    random_device rd;
+    uint64_t db_seed = random_seed();
+
+    // The sockets listen before the children start, so the coordinator can
+    // connect right away; each child accepts once its slice is encoded
+    vector<pid_t> children;
+    vector<int> shard_fds;
+    for (uint32_t s = 0; s < num_shards; s++) {
+        string path = "/tmp/sealpir-shard-" + to_string(getpid()) + "-" + to_string(s) + ".sock";
+        int listen_fd = listen_unix_socket(path);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            cout << "Shard: fork failed" << endl;
+            return -1;
+        }
+        if (pid == 0) {
+            // Connections to the other shards stay with the coordinator only
+            for (int fd : shard_fds) {
+                close(fd);
+            }
+            PIRShardServer shard(params, pir_params, num_shards, s);
+            auto range = shard.element_range(number_of_items, size_per_item);
+            shard.set_database(seeded_database(db_seed, range.first * size_per_item),
+                               number_of_items, size_per_item);
+
+            int fd = accept(listen_fd, nullptr, nullptr);
+            close(listen_fd);
+            unlink(path.c_str());
+            shard.serve(fd);
+            close(fd);
+            _exit(0);
+        }
+
+        close(listen_fd);
+        children.push_back(pid);
+        shard_fds.push_back(connect_unix_socket(path));
+    }
+
+    int status = 0;
+    {
+        PIRShardCoordinator coordinator(params, pir_params, shard_fds);
+        PIRClient client(params, pir_params);
+        coordinator.set_galois_key(0, client.generate_galois_keys());
+
+        uint64_t ele_index = rd() % number_of_items;
+        uint64_t index = client.get_fv_index(ele_index, size_per_item);
+        uint64_t offset = client.get_fv_offset(ele_index, size_per_item);
+        cout << "Shard: element index = " << ele_index << endl;
+
+        PirQuery query = client.generate_query(index);
+        auto time_server_s = high_resolution_clock::now();
+        PirReply reply = coordinator.generate_reply(query, 0);
+        auto time_server_e = high_resolution_clock::now();
+
+        Plaintext result = client.decode_reply(reply);
+        if (!check_seeded_element(params, result, db_seed, ele_index, offset, size_per_item)) {
+            status = -1;
+        }
+        cout << (status == 0 ? "Shard: PIR result correct!" : "Shard: PIR result wrong!") << endl;
+        cout << "Shard: sharded reply generation time: "
+             << duration_cast<microseconds>(time_server_e - time_server_s).count() / 1000
+             << " ms" << endl;
+    }
+
+    // Closing the connections ends the shards
+    for (pid_t pid : children) {
+        int child_status;
+        waitpid(pid, &child_status, 0);
+    }
+    return status;
+}
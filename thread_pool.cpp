@@ -0,0 +1,145 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+using namespace std;
+
+// Set while a thread executes a chunk of a parallel_for, so nested calls run inline.
+static thread_local bool in_parallel_region = false;
+
+// Pool and index of the calling thread, if it is a worker
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local uint32_t current_index = 0;
+
+ThreadPool::ThreadPool(uint32_t num_threads) :
+    num_threads_(max<uint32_t>(1, num_threads)),
+    jobs_(nullptr),
+    stop_(false)
+{
+    for (uint32_t i = 1; i < num_threads_; i++) {
+        workers_.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+}
+
+uint32_t ThreadPool::thread_index() const {
+    return (current_pool == this) ? current_index : 0;
+}
+
+// Takes the next chunk of the oldest job; must hold mutex_.
+bool ThreadPool::take_chunk(Job *&job, uint32_t &chunk) {
+    if (!jobs_) {
+        return false;
+    }
+    job = jobs_;
+    chunk = job->next_chunk++;
+    if (job->next_chunk == job->chunks) {
+        jobs_ = job->next;
+    }
+    return true;
+}
+
+void ThreadPool::run_chunk(Job *job, uint32_t chunk) {
+    exception_ptr error;
+    in_parallel_region = true;
+    try {
+        job->invoke(job->fn, job->count * chunk / job->chunks,
+                    job->count * (chunk + 1) / job->chunks, chunk);
+    } catch (...) {
+        error = current_exception();
+    }
+    in_parallel_region = false;
+
+    lock_guard<mutex> lock(mutex_);
+    if (error && !job->error) {
+        job->error = error;
+    }
+    if (--job->remaining == 0) {
+        job->done.notify_all();
+    }
+}
+
+void ThreadPool::worker_loop(uint32_t index) {
+    current_pool = this;
+    current_index = index;
+    while (true) {
+        Job *job;
+        uint32_t chunk;
+        {
+            unique_lock<mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stop_ || jobs_; });
+            if (!take_chunk(job, chunk)) {
+                return;
+            }
+        }
+        run_chunk(job, chunk);
+    }
+}
+
+void ThreadPool::run(uint64_t count, uint32_t max_chunks, Invoker invoke, const void *fn) {
+    if (count == 0) {
+        return;
+    }
+
+    uint64_t chunks = (max_chunks == 0) ? num_threads_ : min(max_chunks, num_threads_);
+    chunks = min<uint64_t>(chunks, count);
+
+    if (chunks <= 1 || in_parallel_region) {
+        invoke(fn, 0, count, 0);
+        return;
+    }
+
+    Job job;
+    job.invoke = invoke;
+    job.fn = fn;
+    job.count = count;
+    job.chunks = chunks;
+    job.next_chunk = 0;
+    job.remaining = chunks;
+    job.next = nullptr;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        Job **tail = &jobs_;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = &job;
+    }
+    cv_.notify_all();
+
+    // Work on this job alongside the workers until all its chunks are taken
+    while (true) {
+        uint32_t chunk;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (job.next_chunk == job.chunks) {
+                break;
+            }
+            chunk = job.next_chunk++;
+            if (job.next_chunk == job.chunks) {
+                Job **link = &jobs_;
+                while (*link != &job) {
+                    link = &(*link)->next;
+                }
+                *link = job.next;
+            }
+        }
+        run_chunk(&job, chunk);
+    }
+
+    unique_lock<mutex> lock(mutex_);
+    job.done.wait(lock, [&job] { return job.remaining == 0; });
+    if (job.error) {
+        rethrow_exception(job.error);
+    }
+}
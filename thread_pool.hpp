@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size pool of worker threads used to split the server loops across cores.
+// The calling thread always runs one chunk itself, and parallel_for calls made
+// from inside a chunk run inline, so nested loops cannot deadlock the pool.
+// Submitting work does not allocate: the job lives on the caller's stack.
+class ThreadPool {
+  public:
+    // num_threads includes the calling thread, so 1 spawns no workers at all
+    explicit ThreadPool(std::uint32_t num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    std::uint32_t num_threads() const { return num_threads_; }
+
+    // Index in [0, num_threads()) of the calling thread: i for the i-th worker
+    // of this pool and 0 for any other thread. Unlike the chunk passed to
+    // parallel_for, it stays unique when nested loops run inline, so it is
+    // what per-thread scratch space shared by nested loops should use.
+    std::uint32_t thread_index() const;
+
+    // Calls fn(begin, end, chunk) on contiguous ranges covering [0, count) and
+    // returns once all of them are done. chunk is in [0, num_threads()) and is
+    // unique among the ranges of this call, so it can index per-thread scratch
+    // space. max_chunks caps the parallelism (0 means num_threads()).
+    template <typename Fn>
+    void parallel_for(std::uint64_t count, const Fn &fn, std::uint32_t max_chunks = 0) {
+        run(count, max_chunks, &invoke<Fn>, &fn);
+    }
+
+  private:
+    typedef void (*Invoker)(const void *fn, std::uint64_t begin, std::uint64_t end,
+                            std::uint32_t chunk);
+
+    // One parallel_for call; chunks are handed out in order under mutex_
+    struct Job {
+        Invoker invoke;
+        const void *fn;
+        std::uint64_t count;
+        std::uint32_t chunks;
+        std::uint32_t next_chunk;
+        std::uint32_t remaining;
+        std::exception_ptr error;
+        std::condition_variable done;
+        Job *next;
+    };
+
+    std::uint32_t num_threads_;
+    std::vector<std::thread> workers_;
+    Job *jobs_; // jobs that still have chunks to hand out
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+
+    template <typename Fn>
+    static void invoke(const void *fn, std::uint64_t begin, std::uint64_t end, std::uint32_t chunk) {
+        (*static_cast<const Fn *>(fn))(begin, end, chunk);
+    }
+
+    void run(std::uint64_t count, std::uint32_t max_chunks, Invoker invoke, const void *fn);
+    bool take_chunk(Job *&job, std::uint32_t &chunk);
+    void run_chunk(Job *job, std::uint32_t chunk);
+    void worker_loop(std::uint32_t index);
+};